@@ -544,3 +544,42 @@ AC_DEFINE_UNQUOTED(AC_TYPE_NAME, $AC_CV_NAME, [The number of bytes in type $1])
 undefine([AC_TYPE_NAME])dnl
 undefine([AC_CV_NAME])dnl
 ])
+
+# AC_CXX_COMPILE_STDCXX_11 macro for CMConvert
+#
+# Makes sure the C++ compiler accepts C++11 (the hash containers and
+# <atomic> are used).  If it doesn't by default, -std=gnu++11 and then
+# -std=c++11 are tried and the first that works is added to CXXFLAGS.
+
+AC_DEFUN([AC_CXX_COMPILE_STDCXX_11],
+[AC_LANG_PUSH([C++])dnl
+ac_cxx11_test='[#include <unordered_map>
+#include <unordered_set>
+#include <atomic>
+#if !defined(__cplusplus) || __cplusplus < 201103L
+# error C++11 not enabled
+#endif
+]'
+AC_CACHE_CHECK([for $CXX option to enable C++11], ac_cv_cxx_std11,
+[ac_cv_cxx_std11=no
+ac_save_CXXFLAGS="$CXXFLAGS"
+for ac_arg in '' -std=gnu++11 -std=c++11; do
+  CXXFLAGS="$ac_save_CXXFLAGS $ac_arg"
+  AC_COMPILE_IFELSE([AC_LANG_PROGRAM([$ac_cxx11_test],
+      [std::unordered_map<int, int> m; std::atomic<int> n(0);
+       return (int)m.size() + n.load();])],
+    [ac_cv_cxx_std11="$ac_arg"])
+  test "x$ac_cv_cxx_std11" != xno && break
+done
+CXXFLAGS="$ac_save_CXXFLAGS"
+test "x$ac_cv_cxx_std11" = x && ac_cv_cxx_std11="none needed"])
+case "x$ac_cv_cxx_std11" in
+  xno)
+    AC_MSG_ERROR([a C++11 compiler is required]) ;;
+  "xnone needed")
+    ;;
+  *)
+    CXXFLAGS="$CXXFLAGS $ac_cv_cxx_std11" ;;
+esac
+AC_LANG_POP([C++])dnl
+])
@@ -0,0 +1,45 @@
+#!/bin/bash
+# Counts the heap allocations cmconvert makes converting a file, so
+# that two builds can be compared on the same input.  The counter is
+# bench/malloccount.c, built here and loaded with LD_PRELOAD (glibc
+# only).
+#
+# usage: countalloc.sh file cmconvert [cmconvert...] [-- options]
+#
+# Options after "--" are passed to every run (for example -N 5 or
+# --type=multi).  Output goes to a scratch PDB that is removed
+# afterwards.  The counts don't depend on timing, so one run is enough.
+#
+# A typical comparison:
+#	bench/genpq.sh 10000 > pq.gpx
+#	bench/countalloc.sh pq.gpx old/src/cmconvert src/cmconvert -- -N 5
+
+if test $# -lt 2; then
+	echo "usage: $0 file cmconvert [cmconvert...] [-- options]"
+	exit 1
+fi
+
+FILE=$1
+shift
+
+BINS=()
+while test $# -gt 0 && test "$1" != "--"; do
+	BINS+=("$1")
+	shift
+done
+test "$1" = "--" && shift
+
+DIR=`mktemp -d /tmp/countalloc.XXXXXX`
+trap 'rm -rf "$DIR"' EXIT
+
+if ! ${CC:-cc} -shared -fPIC -O2 -o "$DIR/malloccount.so" \
+		"`dirname $0`/malloccount.c"; then
+	echo "$0: can't build malloccount.so"
+	exit 1
+fi
+
+for bin in "${BINS[@]}"; do
+	line=$(LD_PRELOAD="$DIR/malloccount.so" "$bin" -q -o "$DIR/out.pdb" \
+		"$@" "$FILE" 2>&1 > /dev/null | grep '^malloccount:' | tail -1)
+	printf "%-40s %s\n" "$bin" "${line#malloccount: }"
+done
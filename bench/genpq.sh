@@ -0,0 +1,84 @@
+#!/bin/sh
+# Writes a synthetic Groundspeak pocket query to standard output, for
+# timing the parser on something shaped like a real one.
+#
+# usage: genpq.sh [caches] [seed] [gpx-version]
+#
+# Each cache has an HTML long description of 1-30 paragraphs with
+# entities, up to 25 logs, attributes and sometimes a travel bug.  The
+# defaults (10000 caches, GPX 1.0) give a file of about 160 MB.
+
+COUNT=${1:-10000}
+SEED=${2:-1}
+VER=${3:-1.0}
+
+awk -v count=$COUNT -v seed=$SEED -v ver=$VER '
+function pick(list,    n, a) {
+	n = split(list, a, "|")
+	return a[int(rand() * n) + 1]
+}
+BEGIN {
+	srand(seed)
+	types = "Traditional Cache|Multi-cache|Unknown Cache|Letterbox Hybrid"
+	conts = "Micro|Small|Regular|Large|Other"
+	states = "Oregon|Washington|California|Idaho"
+	ents = "&amp;nbsp;|&amp;eacute;|&amp;mdash;|&amp;#8217;|&amp;hellip;|&amp;copy;|&amp;bogus;|&amp;#x41;"
+	gs = "http://www.groundspeak.com/cache/1/0"
+
+	print "<?xml version=\"1.0\" encoding=\"utf-8\"?>"
+	printf "<gpx xmlns:xsi=\"http://www.w3.org/2001/XMLSchema-instance\" version=\"%s\" creator=\"Groundspeak\" xmlns=\"http://www.topografix.com/GPX/1/0\" xmlns:groundspeak=\"%s\">\n", ver, gs
+	printf "<name>PQ</name><time>2010-0%d-12T10:00:00.000Z</time>\n", seed % 9 + 1
+
+	for (i = 0; i < count; i++) {
+		printf "<wpt lat=\"%.6f\" lon=\"%.6f\">\n", 40 + rand() * 8, -124 + rand() * 8
+		printf "<time>2005-03-%02dT08:00:00</time><name>GC%04X</name>", i % 28 + 1, i * 7 + seed
+		printf "<desc>Cache %d &amp; \"stuff\" by O%d</desc>\n", i, i % 50
+		if (ver == "1.1")
+			printf "<link href=\"http://www.geocaching.com/seek/cache_details.aspx?guid=%d\"><text>x</text></link>\n<sym>%s</sym><type>Geocache|%s</type>\n<extensions>", i, pick("Geocache|Geocache Found"), pick(types)
+		else
+			printf "<url>http://www.geocaching.com/seek/cache_details.aspx?guid=%d</url>\n<sym>%s</sym><type>Geocache|%s</type>\n", i, pick("Geocache|Geocache Found"), pick(types)
+
+		printf "<groundspeak:cache id=\"%d\" available=\"%s\" archived=\"%s\" xmlns:groundspeak=\"%s\">\n", i, pick("True|False"), pick("False|False|True"), gs
+		printf "<groundspeak:name>Cache \303\251 %d \342\200\234q\342\200\235</groundspeak:name>", i
+		printf "<groundspeak:placed_by>x</groundspeak:placed_by><groundspeak:owner id=\"1\">Owner%d</groundspeak:owner>\n", i % 50
+		printf "<groundspeak:type>%s</groundspeak:type><groundspeak:container>%s</groundspeak:container>\n", pick(types), pick(conts)
+		printf "<groundspeak:attributes><groundspeak:attribute id=\"1\" inc=\"1\">Dogs</groundspeak:attribute><groundspeak:attribute id=\"2\" inc=\"0\">Night</groundspeak:attribute></groundspeak:attributes>\n"
+		printf "<groundspeak:difficulty>%s</groundspeak:difficulty><groundspeak:terrain>%s</groundspeak:terrain>\n", pick("1.0|1.5|2.0|3.0|4.5"), pick("1.0|2.0|2.5|5.0")
+		printf "<groundspeak:country>United States</groundspeak:country><groundspeak:state>%s</groundspeak:state>\n", pick(states)
+		printf "<groundspeak:short_description html=\"False\">Short desc %d</groundspeak:short_description>\n", i
+
+		printf "<groundspeak:long_description html=\"%s\">", pick("True|true|False")
+		paras = int(rand() * 30) + 1
+		for (k = 0; k < paras; k++) {
+			if (k)
+				printf " "
+			printf "&lt;p&gt;Para %d with &lt;b&gt;bold&lt;/b&gt; %s text &lt;a href=\"http://x.com/%d\"&gt;link&lt;/a&gt;&lt;br&gt;", k, pick(ents), k
+			printf "&lt;ul&gt;&lt;li&gt;one&lt;li&gt;two&lt;/ul&gt;&lt;table&gt;&lt;tr&gt;&lt;td&gt;a&lt;/td&gt;&lt;td&gt;b&lt;/td&gt;&lt;/tr&gt;&lt;/table&gt;"
+			printf "&lt;img src='"'"'http://img/%d.jpg'"'"'&gt; \342\202\254 \302\260", k
+		}
+		printf "</groundspeak:long_description>\n"
+		printf "<groundspeak:encoded_hints>Under [the] rock %d</groundspeak:encoded_hints>\n", i
+
+		printf "<groundspeak:logs>\n"
+		logs = int(rand() * 26)
+		for (l = 0; l < logs; l++) {
+			printf "<groundspeak:log id=\"%d\"><groundspeak:date>2009-0%d-0%dT00:00:00</groundspeak:date>", l, l % 9 + 1, l % 9 + 1
+			printf "<groundspeak:type>%s</groundspeak:type><groundspeak:finder id=\"1\">F%d</groundspeak:finder>", pick("Found it|Didn'"'"'t find it|Write note"), l
+			if (l % 5 == 0)
+				printf "<groundspeak:log_wpt lat=\"45.1\" lon=\"-122.2\"/>"
+			printf "<groundspeak:text encoded=\"%s\">Log text %d ", pick("True|False"), l
+			words = int(rand() * 200) + 1
+			for (k = 0; k < words; k++)
+				printf "blah "
+			printf " &lt;b&gt;TFTC&lt;/b&gt; %s</groundspeak:text></groundspeak:log>\n", pick(ents)
+		}
+		printf "</groundspeak:logs><groundspeak:travelbugs>"
+		if (i % 3 == 0)
+			printf "<groundspeak:travelbug id=\"1\" ref=\"TB1\"><groundspeak:name>Bug %d</groundspeak:name></groundspeak:travelbug>", i
+		printf "</groundspeak:travelbugs></groundspeak:cache>\n"
+		if (ver == "1.1")
+			printf "</extensions>"
+		printf "</wpt>\n"
+	}
+	print "</gpx>"
+}'
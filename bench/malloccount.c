@@ -0,0 +1,55 @@
+/*
+    Counts the allocations a program makes, for comparing two builds of
+    cmconvert.  Load it with LD_PRELOAD (bench/countalloc.sh does this);
+    the totals are written to standard error when the program exits, on
+    a line starting with "malloccount:".
+
+    operator new goes through malloc, so C++ allocations are counted
+    too.  Needs glibc, whose __libc_* entry points are used to avoid
+    looking the real functions up with dlsym (which allocates).
+
+	cc -shared -fPIC -O2 -o malloccount.so malloccount.c
+*/
+
+#include <stdio.h>
+#include <unistd.h>
+
+extern void *__libc_malloc(size_t);
+extern void *__libc_calloc(size_t, size_t);
+extern void *__libc_realloc(void *, size_t);
+
+static unsigned long nMallocs, nCallocs, nReallocs, nBytes;
+
+void *malloc(size_t nSize)
+{
+	__sync_fetch_and_add(&nMallocs, 1);
+	__sync_fetch_and_add(&nBytes, nSize);
+	return __libc_malloc(nSize);
+}
+
+void *calloc(size_t nCount, size_t nSize)
+{
+	__sync_fetch_and_add(&nCallocs, 1);
+	__sync_fetch_and_add(&nBytes, nCount * nSize);
+	return __libc_calloc(nCount, nSize);
+}
+
+void *realloc(void *pOld, size_t nSize)
+{
+	__sync_fetch_and_add(&nReallocs, 1);
+	__sync_fetch_and_add(&nBytes, nSize);
+	return __libc_realloc(pOld, nSize);
+}
+
+// Written with write(), as stdio may allocate
+static void __attribute__((destructor)) Report(void)
+{
+	char szLine[160];
+	int n = snprintf(szLine, sizeof(szLine),
+		"malloccount: %lu allocations (%lu malloc, %lu calloc, "
+		"%lu realloc), %lu bytes\n",
+		nMallocs + nCallocs + nReallocs, nMallocs, nCallocs,
+		nReallocs, nBytes);
+	if (n > 0)
+		n = write(2, szLine, n);
+}
@@ -0,0 +1,49 @@
+#!/bin/bash
+# Times cmconvert converting a file, best of several runs, so that two
+# builds can be compared on the same input.
+#
+# usage: timeparse.sh [-n runs] file cmconvert [cmconvert...] [-- options]
+#
+# Options after "--" are passed to every run (for example -j 2 or
+# --radius=...).  Output goes to a scratch PDB that is removed afterwards.
+#
+# A typical comparison:
+#	bench/genpq.sh 10000 > pq.gpx
+#	bench/timeparse.sh pq.gpx old/src/cmconvert src/cmconvert
+
+RUNS=3
+if test "$1" = "-n"; then
+	RUNS=$2
+	shift 2
+fi
+
+if test $# -lt 2; then
+	echo "usage: $0 [-n runs] file cmconvert [cmconvert...] [-- options]"
+	exit 1
+fi
+
+FILE=$1
+shift
+
+BINS=()
+while test $# -gt 0 && test "$1" != "--"; do
+	BINS+=("$1")
+	shift
+done
+test "$1" = "--" && shift
+
+PDB=`mktemp /tmp/timeparse.XXXXXX`
+TIMEFORMAT=%R
+
+for bin in "${BINS[@]}"; do
+	best=
+	for ((i = 0; i < RUNS; i++)); do
+		t=$( { time "$bin" -q -o "$PDB" "$@" "$FILE" > /dev/null; } 2>&1 )
+		if test -z "$best" || awk "BEGIN { exit !($t < $best) }"; then
+			best=$t
+		fi
+	done
+	printf "%-40s %6s s\n" "$bin" "$best"
+done
+
+rm -f "$PDB"
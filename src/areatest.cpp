@@ -0,0 +1,432 @@
+/*
+    Copyright 2003-2010 Brian Smith (brian@smittyware.com)
+    This file is part of CMConvert.
+
+    CMConvert is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    CMConvert is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with CMConvert; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+*/
+
+// Checks the multi-center and route distance filters (CWPFilter's
+// areas) against a reference that finds the nearest point of each leg
+// by searching along it, rather than by the pole of its great circle.
+// Run by "make check".
+
+#include "common.h"
+#include "wplist.h"
+#include "filter.h"
+
+#ifdef HAVE_LIBM
+
+// Reference distances this close to the radius are not held against
+// the filter (the search is good to far better than this)
+#define AREA_BORDER 1e-8
+
+static double Random(double dMin, double dMax)
+{
+	return dMin + (dMax - dMin) * rand() / RAND_MAX;
+}
+
+static void ToVector(double dLat, double dLon, double *pVec)
+{
+	dLat *= RAD_PER_DEG;
+	dLon *= RAD_PER_DEG;
+
+	pVec[0] = cos(dLat) * cos(dLon);
+	pVec[1] = cos(dLat) * sin(dLon);
+	pVec[2] = sin(dLat);
+}
+
+static void FromVector(const double *pVec, double &rLat, double &rLon)
+{
+	double dLen = sqrt(pVec[0] * pVec[0] + pVec[1] * pVec[1] +
+		pVec[2] * pVec[2]);
+
+	rLat = asin(pVec[2] / dLen) / RAD_PER_DEG;
+	rLon = atan2(pVec[1], pVec[0]) / RAD_PER_DEG;
+}
+
+// Angle between two unit vectors
+static double Angle(const double *pVec1, const double *pVec2)
+{
+	double aCross[3];
+	aCross[0] = pVec1[1] * pVec2[2] - pVec1[2] * pVec2[1];
+	aCross[1] = pVec1[2] * pVec2[0] - pVec1[0] * pVec2[2];
+	aCross[2] = pVec1[0] * pVec2[1] - pVec1[1] * pVec2[0];
+
+	return atan2(sqrt(aCross[0] * aCross[0] + aCross[1] * aCross[1] +
+		aCross[2] * aCross[2]), pVec1[0] * pVec2[0] +
+		pVec1[1] * pVec2[1] + pVec1[2] * pVec2[2]);
+}
+
+// The point a fraction of the way along the shorter arc between two
+// ends that are dLen apart
+static void AlongArc(const double *pEnd1, const double *pEnd2,
+	double dLen, double dPart, double *pOut)
+{
+	double dWeight1 = sin((1 - dPart) * dLen) / sin(dLen);
+	double dWeight2 = sin(dPart * dLen) / sin(dLen);
+
+	for (int i=0; i<3; i++)
+		pOut[i] = dWeight1 * pEnd1[i] + dWeight2 * pEnd2[i];
+}
+
+static double AngleAlong(const double *pVec, const double *pEnd1,
+	const double *pEnd2, double dLen, double dPart)
+{
+	double aPoint[3];
+	AlongArc(pEnd1, pEnd2, dLen, dPart, aPoint);
+	return Angle(pVec, aPoint);
+}
+
+// Distance from a point to a leg: sample the arc, then narrow down on
+// the nearest sample by ternary search (the distance has one minimum
+// between the neighbors of that sample)
+static double LegDistance(const double *pVec, const double *pEnd1,
+	const double *pEnd2)
+{
+	double dLen = Angle(pEnd1, pEnd2);
+	if (dLen < 1e-12)
+		return Angle(pVec, pEnd1);
+
+	int nSamples = (int)(dLen / 0.02) + 2;
+	int i, nBest = 0;
+	double dBest = 10.0;
+
+	for (i=0; i<=nSamples; i++)
+	{
+		double dAngle = AngleAlong(pVec, pEnd1, pEnd2, dLen,
+			(double)i / nSamples);
+		if (dAngle < dBest)
+		{
+			dBest = dAngle;
+			nBest = i;
+		}
+	}
+
+	double dLow = (nBest > 0) ? (double)(nBest - 1) / nSamples : 0.0;
+	double dHigh = (nBest < nSamples) ?
+		(double)(nBest + 1) / nSamples : 1.0;
+
+	for (i=0; i<100; i++)
+	{
+		double dPart1 = dLow + (dHigh - dLow) / 3;
+		double dPart2 = dHigh - (dHigh - dLow) / 3;
+
+		if (AngleAlong(pVec, pEnd1, pEnd2, dLen, dPart1) <
+				AngleAlong(pVec, pEnd1, pEnd2, dLen, dPart2))
+			dHigh = dPart2;
+		else
+			dLow = dPart1;
+	}
+
+	double dAngle = AngleAlong(pVec, pEnd1, pEnd2, dLen,
+		(dLow + dHigh) / 2);
+	return (dAngle < dBest) ? dAngle : dBest;
+}
+
+typedef struct
+{
+	double dLat;
+	double dLon;
+} stRoutePoint;
+
+static void AddPoint(CWPList &rList, double dLat, double dLon)
+{
+	char szName[16];
+	sprintf(szName, "P%06d", (int)rList.m_List.size());
+
+	CWPData *pWP = rList.NewWP();
+	pWP->m_sWaypoint = szName;
+	pWP->m_dLat = dLat;
+	pWP->m_dLon = dLon;
+	rList.AddWP(pWP);
+}
+
+// Random points, points either side of the edge of the corridor
+// around each leg (and around its ends), and one with no position
+static void FillList(CWPList &rList, const stRoutePoint *pRoute,
+	int nPoints, double dDist)
+{
+	static const double aOffsets[] = {
+		-1e-5, -1e-7, 1e-7, 1e-5, -0.01, 0.01
+	};
+	int i, j, k;
+
+	for (i=0; i<1000; i++)
+		AddPoint(rList, Random(-90.0, 90.0), Random(-180.0, 180.0));
+
+	for (i=0; i+1<nPoints; i++)
+	{
+		double aEnd1[3], aEnd2[3], aPole[3];
+		ToVector(pRoute[i].dLat, pRoute[i].dLon, aEnd1);
+		ToVector(pRoute[i+1].dLat, pRoute[i+1].dLon, aEnd2);
+
+		double dLen = Angle(aEnd1, aEnd2);
+		if (dLen < 1e-6 || M_PI - dLen < 1e-6)
+			continue;
+
+		aPole[0] = aEnd1[1] * aEnd2[2] - aEnd1[2] * aEnd2[1];
+		aPole[1] = aEnd1[2] * aEnd2[0] - aEnd1[0] * aEnd2[2];
+		aPole[2] = aEnd1[0] * aEnd2[1] - aEnd1[1] * aEnd2[0];
+		double dSin = sqrt(aPole[0] * aPole[0] + aPole[1] * aPole[1] +
+			aPole[2] * aPole[2]);
+
+		for (j=0; j<60; j++)
+		{
+			double aPoint[3], aOut[3];
+			AlongArc(aEnd1, aEnd2, dLen, Random(-0.1, 1.1), aPoint);
+
+			for (k=0; k<(int)(sizeof(aOffsets) /
+					sizeof(aOffsets[0])); k++)
+			{
+				double dAngle = dDist + aOffsets[k];
+				if (rand() & 1)
+					dAngle = -dAngle;
+
+				for (int n=0; n<3; n++)
+				{
+					aOut[n] = cos(dAngle) * aPoint[n] +
+						sin(dAngle) * aPole[n] / dSin;
+				}
+
+				double dLat, dLon;
+				FromVector(aOut, dLat, dLon);
+				AddPoint(rList, dLat, dLon);
+			}
+		}
+	}
+
+	for (i=0; i<nPoints; i++)
+	{
+		for (j=0; j<20; j++)
+		{
+			double dLat = pRoute[i].dLat + Random(-1.0, 1.0) *
+				dDist / RAD_PER_DEG;
+			double dLon = pRoute[i].dLon + Random(-1.0, 1.0) *
+				dDist / RAD_PER_DEG;
+			if (dLat > 90.0 || dLat < -90.0)
+				dLat = pRoute[i].dLat;
+			AddPoint(rList, dLat, dLon);
+		}
+	}
+
+	AddPoint(rList, NAN, NAN);
+}
+
+// A route through the given points, against the nearest leg found by
+// search.  Ends too far apart for one great circle only count as two
+// centers, as the filter takes them.
+static int CheckRoute(const char *szName, const stRoutePoint *pRoute,
+	int nPoints, double dDist)
+{
+	CWPFilter filter;
+	int i;
+
+	for (i=0; i+1<nPoints; i++)
+	{
+		filter.AddArea(pRoute[i].dLat, pRoute[i].dLon,
+			pRoute[i+1].dLat, pRoute[i+1].dLon, dDist);
+	}
+	filter.Compile();
+
+	CWPList list;
+	FillList(list, pRoute, nPoints, dDist);
+
+	int nFailed = 0, nChecked = 0;
+	WPList::iterator iter;
+
+	for (iter=list.m_List.begin(); iter!=list.m_List.end(); iter++)
+	{
+		CWPData *pWP = *iter;
+		double dNearest = 10.0;
+
+		if (pWP->HasPosition())
+		{
+			double aVec[3];
+			ToVector(pWP->m_dLat, pWP->m_dLon, aVec);
+
+			for (i=0; i+1<nPoints; i++)
+			{
+				double aEnd1[3], aEnd2[3];
+				ToVector(pRoute[i].dLat, pRoute[i].dLon, aEnd1);
+				ToVector(pRoute[i+1].dLat, pRoute[i+1].dLon,
+					aEnd2);
+
+				double dAngle;
+				if (M_PI - Angle(aEnd1, aEnd2) < RADIUS_SLACK)
+				{
+					dAngle = Angle(aVec, aEnd1);
+					double dAngle2 = Angle(aVec, aEnd2);
+					if (dAngle2 < dAngle)
+						dAngle = dAngle2;
+				}
+				else
+					dAngle = LegDistance(aVec, aEnd1, aEnd2);
+
+				if (dAngle < dNearest)
+					dNearest = dAngle;
+			}
+		}
+
+		if (fabs(dNearest - dDist) < AREA_BORDER)
+			continue;
+		int bWant = (dNearest <= dDist);
+		nChecked++;
+
+		if (filter.Matches(pWP, 1) == bWant)
+			continue;
+
+		if (nFailed < 10)
+		{
+			printf("FAIL: %s radius %.9g: %.12g,%.12g should be %s\n",
+				szName, dDist, pWP->m_dLat, pWP->m_dLon,
+				bWant ? "in" : "out");
+		}
+		nFailed++;
+	}
+
+	// Make sure the border didn't swallow the points meant to test
+	// the edge
+	if (nChecked < (int)list.m_List.size() * 9 / 10)
+	{
+		printf("FAIL: %s radius %.9g: only %d of %d points checked\n",
+			szName, dDist, nChecked, (int)list.m_List.size());
+		nFailed++;
+	}
+
+	return nFailed;
+}
+
+// Several centers at once, which must be the same as any one of them
+// passing CheckRadius
+static int CheckCenters(int nCenters, double dDist)
+{
+	vector<stRoutePoint> centers(nCenters);
+	CWPFilter filter;
+	CWPList list;
+	int i;
+
+	for (i=0; i<nCenters; i++)
+	{
+		centers[i].dLat = Random(-90.0, 90.0);
+		centers[i].dLon = Random(-180.0, 180.0);
+		if (i == 0)
+			centers[i].dLat = 90.0;
+		else if (i == 1)
+			centers[i].dLon = -180.0;
+		else if (i == 2)
+			centers[i].dLon = 179.99;
+
+		filter.AddArea(centers[i].dLat, centers[i].dLon,
+			centers[i].dLat, centers[i].dLon, dDist);
+		FillList(list, &centers[i], 1, dDist);
+	}
+	filter.Compile();
+
+	int nFailed = 0;
+	WPList::iterator iter;
+
+	for (iter=list.m_List.begin(); iter!=list.m_List.end(); iter++)
+	{
+		CWPData *pWP = *iter;
+		int bWant = 0;
+
+		for (i=0; i<nCenters && !bWant; i++)
+		{
+			bWant = CWPFilter::CheckRadius(centers[i].dLat,
+				centers[i].dLon, pWP->m_dLat, pWP->m_dLon, dDist);
+		}
+
+		if (filter.Matches(pWP, 1) == bWant)
+			continue;
+
+		if (nFailed < 10)
+		{
+			printf("FAIL: %d centers radius %.9g: %.12g,%.12g "
+				"should be %s\n", nCenters, dDist, pWP->m_dLat,
+				pWP->m_dLon, bWant ? "in" : "out");
+		}
+		nFailed++;
+	}
+
+	return nFailed;
+}
+
+int main()
+{
+	// Legs either side of and across the 180th meridian
+	static const stRoutePoint aDateLine[] = {
+		{ 10.0, 179.5 }, { 12.0, -179.5 }, { 11.0, -178.0 },
+		{ -20.0, 170.0 }, { -25.0, -170.0 }
+	};
+	// Past the north pole, and along near the south one
+	static const stRoutePoint aPolar[] = {
+		{ 85.0, 0.0 }, { 88.0, 90.0 }, { 86.0, -170.0 },
+		{ 80.0, -100.0 }
+	};
+	static const stRoutePoint aSouth[] = {
+		{ -89.0, 0.0 }, { -89.5, 120.0 }, { -88.0, -120.0 }
+	};
+	// Ends a half turn apart, where there is no one great circle
+	static const stRoutePoint aAntipodes[] = {
+		{ 0.0, 0.0 }, { 0.0, -180.0 }, { 30.0, 40.0 },
+		{ -30.0, -140.0 }
+	};
+	// Long legs, short ones, and the same point twice
+	static const stRoutePoint aMixed[] = {
+		{ 45.0, -120.0 }, { 45.001, -120.001 }, { 45.001, -120.001 },
+		{ -10.0, 60.0 }, { 60.0, 100.0 }, { 60.0, 100.5 }
+	};
+	static const double aRadii[] = { 1e-4, 0.005, 0.1, 1.0 };
+	int nRadii = sizeof(aRadii) / sizeof(aRadii[0]);
+	int nFailed = 0;
+	int i;
+
+	srand(1);
+
+	for (i=0; i<nRadii; i++)
+	{
+		double dDist = aRadii[i];
+
+		nFailed += CheckRoute("date line", aDateLine,
+			sizeof(aDateLine) / sizeof(aDateLine[0]), dDist);
+		nFailed += CheckRoute("north pole", aPolar,
+			sizeof(aPolar) / sizeof(aPolar[0]), dDist);
+		nFailed += CheckRoute("south pole", aSouth,
+			sizeof(aSouth) / sizeof(aSouth[0]), dDist);
+		nFailed += CheckRoute("antipodes", aAntipodes,
+			sizeof(aAntipodes) / sizeof(aAntipodes[0]), dDist);
+		nFailed += CheckRoute("mixed", aMixed,
+			sizeof(aMixed) / sizeof(aMixed[0]), dDist);
+
+		nFailed += CheckCenters(1, dDist);
+		nFailed += CheckCenters(5, dDist);
+		nFailed += CheckCenters(40, dDist);
+	}
+
+	if (nFailed)
+		printf("%d area filter checks failed\n", nFailed);
+
+	return (nFailed != 0);
+}
+
+#else
+
+// Without libm there are no distance filters to check
+int main()
+{
+	return 77;
+}
+
+#endif
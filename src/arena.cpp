@@ -0,0 +1,91 @@
+/*
+    Copyright 2003-2010 Brian Smith (brian@smittyware.com)
+    This file is part of CMConvert.
+
+    CMConvert is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    CMConvert is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with CMConvert; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+*/
+
+#include "common.h"
+#include "arena.h"
+
+// Pieces are aligned for anything a class might hold
+#define ARENA_ALIGN 16
+#define ARENA_ROUND(n) (((n) + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1))
+
+CArena::CArena()
+{
+	m_pBlocks = NULL;
+}
+
+CArena::~CArena()
+{
+	Release();
+}
+
+void* CArena::Alloc(size_t nSize)
+{
+	size_t nHeader = ARENA_ROUND(sizeof(stBlock));
+	nSize = ARENA_ROUND(nSize);
+
+	stBlock *pBlock = m_pBlocks;
+	if (!pBlock || (pBlock->nSize - pBlock->nUsed) < nSize)
+	{	// Oversized pieces get a block of their own
+		size_t nBlock = nHeader + nSize;
+		if (nBlock < ARENA_BLOCK_SIZE)
+			nBlock = ARENA_BLOCK_SIZE;
+
+		pBlock = (stBlock*)new char[nBlock];
+		pBlock->nSize = nBlock;
+		pBlock->nUsed = nHeader;
+		pBlock->pNext = m_pBlocks;
+		m_pBlocks = pBlock;
+	}
+
+	void *p = (char*)pBlock + pBlock->nUsed;
+	pBlock->nUsed += nSize;
+	return p;
+}
+
+void CArena::Adopt(CArena &rArena)
+{
+	stBlock *pFirst = rArena.m_pBlocks;
+	if (!pFirst)
+		return;
+	rArena.m_pBlocks = NULL;
+
+	if (!m_pBlocks)
+	{
+		m_pBlocks = pFirst;
+		return;
+	}
+
+	// Keep handing out pieces from the current block
+	stBlock *pLast = pFirst;
+	while (pLast->pNext)
+		pLast = pLast->pNext;
+
+	pLast->pNext = m_pBlocks->pNext;
+	m_pBlocks->pNext = pFirst;
+}
+
+void CArena::Release()
+{
+	while (m_pBlocks)
+	{
+		stBlock *pNext = m_pBlocks->pNext;
+		delete [] (char*)m_pBlocks;
+		m_pBlocks = pNext;
+	}
+}
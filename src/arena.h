@@ -0,0 +1,51 @@
+/*
+    Copyright 2003-2010 Brian Smith (brian@smittyware.com)
+    This file is part of CMConvert.
+
+    CMConvert is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    CMConvert is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with CMConvert; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+*/
+
+#ifndef _ARENA_H_INCLUDED_
+#define _ARENA_H_INCLUDED_
+
+// Size of each block an arena takes from the heap
+#define ARENA_BLOCK_SIZE (64*1024)
+
+// Memory handed out in pieces that are never freed one at a time.  The
+// blocks behind them all go at once, when the arena is released.
+class CArena
+{
+public:
+	CArena();
+	~CArena();
+
+	void* Alloc(size_t nSize);
+	// Takes over all the blocks of another arena
+	void Adopt(CArena &rArena);
+	void Release();
+
+private:
+	typedef struct stBlock
+	{
+		struct stBlock *pNext;
+		size_t nSize;
+		size_t nUsed;
+	} stBlock;
+
+	// Pieces come from the first block
+	stBlock *m_pBlocks;
+};
+
+#endif // _ARENA_H_INCLUDED_
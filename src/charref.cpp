@@ -0,0 +1,133 @@
+/*
+    Copyright 2003-2010 Brian Smith (brian@smittyware.com)
+    This file is part of CMConvert.
+
+    CMConvert is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    CMConvert is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with CMConvert; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+*/
+
+#include "common.h"
+#include "charref.h"
+
+#include <ctype.h>
+
+CCharRefFilter::CCharRefFilter()
+{
+	m_nHeld = 0;
+}
+
+int CCharRefFilter::CheckCharVal(const char *pVal)
+{
+	u_long val;
+	int legal = 0;
+
+	if (pVal[0] == 'x')
+		val = strtoul(&pVal[1], NULL, 16);
+	else
+		val = strtoul(pVal, NULL, 10);
+
+	if (val < 32)
+	{
+		if (val == 9 || val == 10 || val == 13)
+			legal = 1;
+	}
+	else
+		legal = 1;
+
+	return legal;
+}
+
+int CCharRefFilter::Filter(const char *pIn, int nLen, char *pOut)
+{
+	int i = 0, n = 0;
+
+	while (i < nLen)
+	{
+		if (m_nHeld == 0)
+		{	// Copy everything up to the next '&' in one go
+			const char *pAmp = (const char*)memchr(pIn + i, '&',
+				nLen - i);
+			int nRun = pAmp ? (pAmp - (pIn + i)) : (nLen - i);
+
+			memmove(pOut + n, pIn + i, nRun);
+			n += nRun;
+			i += nRun;
+
+			if (pAmp)
+				m_szHeld[m_nHeld++] = pIn[i++];
+			continue;
+		}
+
+		char ch = pIn[i];
+		int bRef;
+
+		if (m_nHeld == 1)
+			bRef = (ch == '#');
+		else
+			bRef = (ch == ';' || isalnum((unsigned char)ch));
+
+		if (bRef && m_nHeld < CHARREF_MAX)
+		{
+			m_szHeld[m_nHeld++] = ch;
+			i++;
+
+			if (ch != ';')
+				continue;
+
+			m_szHeld[m_nHeld] = 0;
+			if (CheckCharVal(&m_szHeld[2]))
+			{
+				memcpy(pOut + n, m_szHeld, m_nHeld);
+				n += m_nHeld;
+			}
+		}
+		else
+		{	// Not a character reference; pass it through and
+			// look at this character again
+			memcpy(pOut + n, m_szHeld, m_nHeld);
+			n += m_nHeld;
+		}
+
+		m_nHeld = 0;
+	}
+
+	return n;
+}
+
+int CCharRefFilter::CleanLength(const char *pIn, int nLen)
+{
+	const char *pEnd = pIn + nLen;
+	const char *pAmp = pIn;
+
+	while ((pAmp = (const char*)memchr(pAmp, '&', pEnd - pAmp)) != NULL)
+	{
+		// A '&' at the end might start a reference in the next chunk
+		if (pAmp + 1 == pEnd || pAmp[1] == '#')
+			return pAmp - pIn;
+
+		pAmp++;
+	}
+
+	return nLen;
+}
+
+int CCharRefFilter::Flush(char *pOut)
+{
+	int n = m_nHeld;
+
+	memcpy(pOut, m_szHeld, n);
+	m_nHeld = 0;
+
+	return n;
+}
@@ -0,0 +1,53 @@
+/*
+    Copyright 2003-2010 Brian Smith (brian@smittyware.com)
+    This file is part of CMConvert.
+
+    CMConvert is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    CMConvert is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with CMConvert; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+*/
+
+#ifndef _CHARREF_H_INCLUDED_
+#define _CHARREF_H_INCLUDED_
+
+// Longest "&#...;" sequence treated as a character reference.  Filter
+// output may run this far ahead of the input consumed.
+#define CHARREF_MAX 32
+
+// Removes character references to characters that are illegal in XML
+// (Expat rejects them) from a stream of input chunks.  A reference split
+// across chunks is held back until the next chunk completes it.
+class CCharRefFilter
+{
+public:
+	CCharRefFilter();
+
+	// Filter nLen bytes from pIn to pOut, returning the output length.
+	// Filtering in place is allowed when pOut + CHARREF_MAX <= pIn.
+	int Filter(const char *pIn, int nLen, char *pOut);
+	// Output anything still held back at end of input
+	int Flush(char *pOut);
+
+	int Pending() const { return m_nHeld; }
+	// Length of leading input that passes through unchanged, if
+	// nothing is held back
+	static int CleanLength(const char *pIn, int nLen);
+
+private:
+	char m_szHeld[CHARREF_MAX + 1];
+	int m_nHeld;
+
+	static int CheckCharVal(const char *pVal);
+};
+
+#endif // _CHARREF_H_INCLUDED_
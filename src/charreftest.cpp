@@ -0,0 +1,157 @@
+/*
+    Copyright 2003-2010 Brian Smith (brian@smittyware.com)
+    This file is part of CMConvert.
+
+    CMConvert is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    CMConvert is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with CMConvert; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+*/
+
+// Checks that CCharRefFilter gives the same output however its input
+// is cut into chunks.  Run by "make check".
+
+#include "common.h"
+#include "charref.h"
+
+typedef struct
+{
+	const char *szIn;
+	const char *szOut;
+} stCharRefCase;
+
+static const stCharRefCase aCases[] = {
+	{ "a&#8;b", "ab" },
+	{ "a&#9;b", "a&#9;b" },
+	{ "&#x1F;x", "x" },
+	{ "&#x41;", "&#x41;" },
+	{ "&amp;&#1;&lt;", "&amp;&lt;" },
+	{ "&#;", "" },
+	{ "&&#2;#3;", "&#3;" },
+	{ "&# 1;", "&# 1;" },
+	{ "&#0000000000000000000000000000000001;",
+		"&#0000000000000000000000000000000001;" },
+	{ "x&#", "x&#" },
+	{ "&#12", "&#12" },
+	{ "&#65;&#10;&#0;", "&#65;&#10;" },
+	{ "plain", "plain" },
+	{ NULL, NULL }
+};
+
+// Feed sIn to a fresh filter in the chunks ending at each offset in
+// cuts, filtering in place the way the parser does
+static string FilterChunks(const string &sIn, const vector<int> &cuts)
+{
+	CCharRefFilter filter;
+	string sOut;
+	vector<char> buf(CHARREF_MAX + sIn.size() + 1);
+	int nPos = 0;
+
+	for (size_t i=0; i<=cuts.size(); i++)
+	{
+		int nEnd = (i < cuts.size()) ? cuts[i] : (int)sIn.size();
+		int nLen = nEnd - nPos;
+
+		memcpy(&buf[CHARREF_MAX], sIn.data() + nPos, nLen);
+		int n = filter.Filter(&buf[CHARREF_MAX], nLen, &buf[0]);
+		sOut.append(&buf[0], n);
+		nPos = nEnd;
+	}
+
+	char szTail[CHARREF_MAX];
+	int n = filter.Flush(szTail);
+	sOut.append(szTail, n);
+
+	return sOut;
+}
+
+// Every way of cutting each case into (up to) three chunks, which
+// covers every two-way split as well
+static int CheckSplits()
+{
+	int nFailed = 0;
+
+	for (const stCharRefCase *pCase = aCases; pCase->szIn; pCase++)
+	{
+		string sIn = pCase->szIn;
+		int nLen = sIn.size();
+
+		for (int a=0; a<=nLen; a++)
+		{
+			for (int b=a; b<=nLen; b++)
+			{
+				vector<int> cuts;
+				cuts.push_back(a);
+				cuts.push_back(b);
+
+				string sOut = FilterChunks(sIn, cuts);
+				if (sOut == pCase->szOut)
+					continue;
+
+				printf("FAIL: \"%s\" cut at %d,%d gave \"%s\"\n",
+					pCase->szIn, a, b, sOut.c_str());
+				nFailed++;
+			}
+		}
+	}
+
+	return nFailed;
+}
+
+// A long run of references fed one byte at a time
+static int CheckSingleBytes()
+{
+	string sIn, sExpect;
+	char szRef[16];
+
+	for (int i=0; i<2000; i++)
+	{
+		int nVal = i % 40;
+		sprintf(szRef, "t&#%d;", nVal);
+		sIn += szRef;
+
+		if (nVal >= 32 || nVal == 9 || nVal == 10 || nVal == 13)
+			sExpect += szRef;
+		else
+			sExpect += "t";
+	}
+
+	int nFailed = 0;
+	vector<int> cuts;
+
+	if (FilterChunks(sIn, cuts) != sExpect)
+	{
+		printf("FAIL: long input in one chunk\n");
+		nFailed++;
+	}
+
+	for (int i=1; i<(int)sIn.size(); i++)
+		cuts.push_back(i);
+
+	if (FilterChunks(sIn, cuts) != sExpect)
+	{
+		printf("FAIL: long input in 1-byte chunks\n");
+		nFailed++;
+	}
+
+	return nFailed;
+}
+
+int main()
+{
+	int nFailed = CheckSplits() + CheckSingleBytes();
+
+	if (nFailed)
+		printf("%d character reference checks failed\n", nFailed);
+
+	return (nFailed != 0);
+}
@@ -0,0 +1,796 @@
+/*
+    Copyright 2003-2010 Brian Smith (brian@smittyware.com)
+    This file is part of CMConvert.
+
+    CMConvert is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    CMConvert is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with CMConvert; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+*/
+
+#include "common.h"
+#include "filter.h"
+#include "wplist.h"
+#include "util.h"
+
+#ifdef HAVE_LIBM
+#include <math.h>
+#endif
+
+CWPFilter::CWPFilter()
+{
+	m_bFilterBugs = 0;
+	m_bSymFound = 0;
+	m_bSymNotFound = 0;
+	m_bFiltActive = 0;
+	m_bFiltInactive = 0;
+	m_bRadius = 0;
+	m_dLat = m_dLon = m_dDist = 0.0;
+	m_bRadiusBox = 0;
+	m_dLatSpan = m_dLonSpan = 0.0;
+	m_bRadiusMarked = 0;
+	m_bRadiusBatch = 0;
+	m_dCenterLat = m_dCenterLon = m_dCenterCos = 0.0;
+	m_dHavInside = m_dHavOutside = 0.0;
+	m_dAreaCell = AREA_CELL_MIN;
+	m_nAreaRows = m_nAreaCols = 0;
+}
+
+#ifdef HAVE_LIBM
+// Box (in degrees) around a point that holds everything within dDist
+// radians of it.  A point within the radius is no further in latitude
+// than the radius itself, and no further in longitude than where a
+// meridian touches the circle.  Near a pole the longitude bound is all
+// of them (180).  The slack covers rounding in CheckRadius.
+static void RadiusBox(double dLat, double dDist, double &rLatSpan,
+	double &rLonSpan)
+{
+	dLat *= RAD_PER_DEG;
+	rLatSpan = (dDist + RADIUS_SLACK) / RAD_PER_DEG;
+
+	if (fabs(dLat) + dDist < M_PI/2 - RADIUS_SLACK)
+	{
+		rLonSpan = (asin(sin(dDist) / cos(dLat)) + RADIUS_SLACK) /
+			RAD_PER_DEG;
+		if (rLonSpan > 180.0)
+			rLonSpan = 180.0;
+	}
+	else
+		rLonSpan = 180.0;
+}
+#endif
+
+void CWPFilter::Compile()
+{
+	m_ContMatch.Compile(m_sContFilt);
+	m_CountryMatch.Compile(m_sCountryFilt);
+	m_StateMatch.Compile(m_sStateFilt);
+	m_TypeMatch.Compile(m_sTypeFilt);
+	m_SymMatch.Compile(m_sSymFilt);
+	m_OwnerMatch.Compile(m_sOwnerFilt);
+	m_ExcludeMatch.Compile(m_sExcludeFilt);
+
+	m_bRadiusBox = 0;
+	m_bRadiusMarked = 0;
+	m_bRadiusBatch = 0;
+
+#ifdef HAVE_LIBM
+	CompileAreas();
+
+	if (!m_bRadius)
+		return;
+
+	// A point is within the radius when the haversine of its distance
+	// is no more than that of the radius (so no atan2 or sqrt).  Past
+	// half the globe that no longer holds, and it's all CheckRadius.
+	m_dCenterLat = m_dLat * RAD_PER_DEG;
+	m_dCenterLon = m_dLon * RAD_PER_DEG;
+	m_dCenterCos = cos(m_dCenterLat);
+	if (m_dDist < M_PI - RADIUS_SLACK)
+	{
+		double dHav = pow(sin(m_dDist/2), 2);
+		double dSlack = dHav * BATCH_SLACK_REL + BATCH_SLACK_ABS;
+
+		m_dHavInside = dHav - dSlack;
+		m_dHavOutside = dHav + dSlack;
+		m_bRadiusBatch = (fabs(m_dLat) <= 90.0);
+	}
+
+	RadiusBox(m_dLat, m_dDist, m_dLatSpan, m_dLonSpan);
+	m_bRadiusBox = (fabs(m_dLat) <= 90.0);
+#endif
+}
+
+// Whether any waypoint can fail the filters
+int CWPFilter::IsActive()
+{
+	return (!m_Waypoints.empty() || m_bFilterBugs || m_bSymFound ||
+		m_bSymNotFound || m_bFiltActive || m_bFiltInactive ||
+		!m_sContFilt.empty() || !m_sCountryFilt.empty() ||
+		!m_sStateFilt.empty() || !m_sTypeFilt.empty() ||
+		!m_sSymFilt.empty() || !m_sOwnerFilt.empty() ||
+		!m_sExcludeFilt.empty() || m_bRadius
+#ifdef HAVE_LIBM
+		|| !m_Areas.empty()
+#endif
+		);
+}
+
+// Unless bFinal is set, the travel bug filter is left out (bugs are
+// listed after the rest of a cache, so they're the last thing known)
+int CWPFilter::Matches(CWPData *pWP, int bFinal)
+{
+	if (!m_Waypoints.empty() &&
+			!m_Waypoints.count(pWP->m_sWaypoint))
+		return 0;
+
+	// Travel bug filter
+	if (bFinal && m_bFilterBugs && !pWP->m_bTravelBugs)
+		return 0;
+
+	// Found/not found filter
+	if (m_bSymFound && (pWP->m_sSymbol != "Geocache Found"))
+		return 0;
+	if (m_bSymNotFound && (pWP->m_sSymbol != "Geocache"))
+		return 0;
+
+	// Cache active/inactive filter
+	if (m_bFiltActive && !pWP->m_bActive)
+		return 0;
+	if (m_bFiltInactive && pWP->m_bActive)
+		return 0;
+
+	// String filters
+	if (!m_ContMatch.Matches(pWP->m_sContainer))
+		return 0;
+	if (!m_CountryMatch.Matches(pWP->m_sCountry))
+		return 0;
+	if (!m_StateMatch.Matches(pWP->m_sState))
+		return 0;
+	if (!m_TypeMatch.Matches(pWP->m_sType))
+		return 0;
+	if (!m_SymMatch.Matches(pWP->m_sSymbol))
+		return 0;
+	if (!m_OwnerMatch.Matches(pWP->m_sOwner))
+		return 0;
+
+	if (m_ExcludeMatch.IsSet())
+	{
+		if (m_ExcludeMatch.Matches(pWP->m_sWaypoint))
+			return 0;
+	}
+
+#ifdef HAVE_LIBM
+	if (m_bRadius)
+	{
+		if (m_bRadiusMarked ? !pWP->m_bInRadius : !InRadius(pWP))
+			return 0;
+	}
+
+	if (!m_Areas.empty() && !InAreas(pWP))
+		return 0;
+#endif
+
+	return 1;
+}
+
+#ifdef HAVE_LIBM
+// The great circle test, for points that aren't plainly outside the
+// box around the center
+int CWPFilter::InRadius(CWPData *pWP)
+{
+	if (m_bRadiusBox && pWP->HasPosition())
+	{
+		if (fabs(pWP->m_dLat - m_dLat) > m_dLatSpan)
+			return 0;
+
+		if (m_dLonSpan < 180.0)
+		{
+			double dDiff = fabs(fmod(pWP->m_dLon - m_dLon, 360.0));
+			if (dDiff > 180.0)
+				dDiff = 360.0 - dDiff;
+			if (dDiff > m_dLonSpan)
+				return 0;
+		}
+	}
+
+	return CheckRadius(m_dLat, m_dLon, pWP->m_dLat, pWP->m_dLon,
+		m_dDist);
+}
+
+void CWPFilter::MarkInRadius(CWPList *pList)
+{
+	WPList::iterator iter;
+	for (iter=pList->m_List.begin(); iter!=pList->m_List.end(); iter++)
+		(*iter)->m_bInRadius = 0;
+
+	WPList found;
+	if (m_bRadiusBox)
+	{
+		pList->FindNear(m_dLat, m_dLon, m_dLatSpan, m_dLonSpan,
+			found);
+	}
+	else
+		found = pList->m_List;
+
+	// Candidates the batch test can take are gathered into blocks of
+	// columns; the others are checked one at a time
+	stCoordBlock block;
+	CWPData *aBlockWP[RADIUS_BLOCK];
+	int nFill = 0;
+
+	for (iter=found.begin(); iter!=found.end(); iter++)
+	{
+		CWPData *pWP = *iter;
+
+		if (!m_bRadiusBatch || !pWP->HasPosition() ||
+				fabs(pWP->m_dLon) > 180.0)
+		{
+			pWP->m_bInRadius = InRadius(pWP);
+			continue;
+		}
+
+		aBlockWP[nFill] = pWP;
+		block.dLat[nFill] = pWP->m_dLat;
+		block.dLon[nFill] = pWP->m_dLon;
+		nFill++;
+
+		if (nFill == RADIUS_BLOCK)
+		{
+			MarkBlock(block, aBlockWP, nFill);
+			nFill = 0;
+		}
+	}
+
+	if (nFill)
+		MarkBlock(block, aBlockWP, nFill);
+
+	m_bRadiusMarked = 1;
+}
+
+// sin(x) for |x| <= pi/2, from its series up to x^21 (good to about
+// 1e-18 there).  Plain arithmetic, so loops over it can be vectorized.
+static inline double SinSeries(double x)
+{
+	double x2 = x * x;
+
+	return x * (1.0 + x2 * (-1.0/6 + x2 * (1.0/120 +
+		x2 * (-1.0/5040 + x2 * (1.0/362880 +
+		x2 * (-1.0/39916800 + x2 * (1.0/6227020800.0 +
+		x2 * (-1.0/1307674368000.0 + x2 * (1.0/355687428096000.0 +
+		x2 * (-1.0/121645100408832000.0 +
+		x2 * (1.0/51090942171709440000.0)))))))))));
+}
+
+// Haversines of the distances from the center of the filter for a
+// block of coordinates, all with latitudes in [-90, 90] and longitudes
+// in [-180, 180]
+void CWPFilter::HaversineBlock(stCoordBlock &rBlock)
+{
+	const double dHalfPi = M_PI / 2;
+	int i;
+
+	// Copies, as the block could otherwise alias the members
+	double dCenterLat = m_dCenterLat, dCenterLon = m_dCenterLon;
+	double dCenterCos = m_dCenterCos;
+
+	// A fixed count (and no branches) lets the compiler vectorize this
+	for (i=0; i<RADIUS_BLOCK; i++)
+	{
+		double dLat = rBlock.dLat[i] * RAD_PER_DEG;
+		double dLon = rBlock.dLon[i] * RAD_PER_DEG;
+
+		// Half of each difference; sin^2 of the longitude one has a
+		// period of pi, which folds it into the range of the series
+		double dHalfLat = (dLat - dCenterLat) / 2;
+		double dHalfLon = fabs(dLon - dCenterLon) / 2;
+		dHalfLon = dHalfPi - fabs(dHalfPi - dHalfLon);
+
+		double dSinLat = SinSeries(dHalfLat);
+		double dSinLon = SinSeries(dHalfLon);
+		double dCos = SinSeries(dHalfPi - fabs(dLat));
+
+		rBlock.dHav[i] = dSinLat * dSinLat +
+			dCenterCos * dCos * dSinLon * dSinLon;
+	}
+}
+
+// Sets m_bInRadius for the first nCount waypoints of a block, leaving
+// those too close to the radius to call to CheckRadius
+void CWPFilter::MarkBlock(stCoordBlock &rBlock, CWPData **pWPs,
+	int nCount)
+{
+	int i;
+	for (i=nCount; i<RADIUS_BLOCK; i++)
+		rBlock.dLat[i] = rBlock.dLon[i] = 0.0;
+
+	HaversineBlock(rBlock);
+
+	for (i=0; i<nCount; i++)
+	{
+		CWPData *pWP = pWPs[i];
+		double dHav = rBlock.dHav[i];
+
+		if (dHav < m_dHavInside)
+			pWP->m_bInRadius = 1;
+		else if (dHav > m_dHavOutside)
+			pWP->m_bInRadius = 0;
+		else
+		{
+			pWP->m_bInRadius = CheckRadius(m_dLat, m_dLon,
+				pWP->m_dLat, pWP->m_dLon, m_dDist);
+		}
+	}
+}
+
+int CWPFilter::CheckRadius(double dLat1, double dLon1, double dLat2,
+	double dLon2, double dDist)
+{
+	double ddLat, ddLon, a, c;
+
+	dLat1 *= RAD_PER_DEG;
+	dLon1 *= RAD_PER_DEG;
+	dLat2 *= RAD_PER_DEG;
+	dLon2 *= RAD_PER_DEG;
+
+	ddLat = dLat2 - dLat1;
+	ddLon = dLon2 - dLon1;
+
+	if (ddLat == 0.0 && ddLon == 0.0)
+		return 1;
+
+	a = pow(sin(ddLat/2), 2) + cos(dLat1) * cos(dLat2) *
+		pow(sin(ddLon/2), 2);
+	c = 2 * atan2(sqrt(a), sqrt(1-a));
+
+	return (c <= dDist);
+}
+#endif
+
+#ifdef HAVE_LIBM
+void CWPFilter::AddArea(double dLat1, double dLon1, double dLat2,
+	double dLon2, double dDist)
+{
+	stArea area;
+	area.dLat1 = dLat1;
+	area.dLon1 = dLon1;
+	area.dLat2 = dLat2;
+	area.dLon2 = dLon2;
+	area.dDist = dDist;
+
+	m_Areas.push_back(area);
+}
+
+void CWPFilter::ClearAreas()
+{
+	m_Areas.clear();
+	m_Pieces.clear();
+	m_AreaGrid.clear();
+}
+
+static void ToVector(double dLat, double dLon, double *pVec)
+{
+	dLat *= RAD_PER_DEG;
+	dLon *= RAD_PER_DEG;
+
+	pVec[0] = cos(dLat) * cos(dLon);
+	pVec[1] = cos(dLat) * sin(dLon);
+	pVec[2] = sin(dLat);
+}
+
+static double Dot(const double *pVec1, const double *pVec2)
+{
+	return (pVec1[0] * pVec2[0] + pVec1[1] * pVec2[1] +
+		pVec1[2] * pVec2[2]);
+}
+
+static void Cross(const double *pVec1, const double *pVec2, double *pOut)
+{
+	pOut[0] = pVec1[1] * pVec2[2] - pVec1[2] * pVec2[1];
+	pOut[1] = pVec1[2] * pVec2[0] - pVec1[0] * pVec2[2];
+	pOut[2] = pVec1[0] * pVec2[1] - pVec1[1] * pVec2[0];
+}
+
+static bool AreaCellLess(const stAreaCell &rCell1, const stAreaCell &rCell2)
+{
+	if (rCell1.nCell != rCell2.nCell)
+		return (rCell1.nCell < rCell2.nCell);
+
+	return (rCell1.nPiece < rCell2.nPiece);
+}
+
+static bool AreaCellSame(const stAreaCell &rCell1,
+	const stAreaCell &rCell2)
+{
+	return (rCell1.nCell == rCell2.nCell &&
+		rCell1.nPiece == rCell2.nPiece);
+}
+
+// Cuts the centers and segments into pieces and puts them in the grid
+void CWPFilter::CompileAreas()
+{
+	m_Pieces.clear();
+	m_AreaGrid.clear();
+
+	AreaList::iterator iter;
+	for (iter=m_Areas.begin(); iter!=m_Areas.end(); iter++)
+		SplitArea(*iter);
+
+	m_dAreaCell = AREA_CELL_MIN;
+	int i, nCount = m_Pieces.size();
+	for (i=0; i<nCount; i++)
+	{
+		double dSpan = (m_Pieces[i].dReach + RADIUS_SLACK) /
+			RAD_PER_DEG;
+		if (dSpan > m_dAreaCell)
+			m_dAreaCell = dSpan;
+	}
+	if (m_dAreaCell > 90.0)
+		m_dAreaCell = 90.0;
+
+	m_nAreaRows = (long)ceil(180.0 / m_dAreaCell);
+	m_nAreaCols = (long)ceil(360.0 / m_dAreaCell);
+
+	for (i=0; i<nCount; i++)
+	{
+		stAreaPiece &rPiece = m_Pieces[i];
+
+		AddAreaCells(i, rPiece.dLat1, rPiece.dLon1, rPiece.dReach);
+		if (!rPiece.bCenter)
+		{
+			AddAreaCells(i, rPiece.dLat2, rPiece.dLon2,
+				rPiece.dReach);
+		}
+	}
+
+	sort(m_AreaGrid.begin(), m_AreaGrid.end(), AreaCellLess);
+	m_AreaGrid.erase(unique(m_AreaGrid.begin(), m_AreaGrid.end(),
+		AreaCellSame), m_AreaGrid.end());
+}
+
+// Everything near a piece is within dReach of one of its ends, as no
+// point of the piece is further than half its length from both
+void CWPFilter::AddPiece(stAreaPiece &rPiece, double dLen)
+{
+	rPiece.dReach = rPiece.dDist + dLen/2 + RADIUS_SLACK;
+	m_Pieces.push_back(rPiece);
+}
+
+void CWPFilter::SplitArea(stArea &rArea)
+{
+	stAreaPiece piece;
+	piece.dDist = rArea.dDist;
+	piece.dSinDist = sin(rArea.dDist < M_PI/2 ? rArea.dDist : M_PI/2);
+	piece.dLat1 = piece.dLat2 = rArea.dLat1;
+	piece.dLon1 = piece.dLon2 = rArea.dLon1;
+	piece.bCenter = 1;
+
+	double aEnd1[3], aEnd2[3], aPole[3];
+	ToVector(rArea.dLat1, rArea.dLon1, aEnd1);
+	ToVector(rArea.dLat2, rArea.dLon2, aEnd2);
+	Cross(aEnd1, aEnd2, aPole);
+
+	double dSin = sqrt(Dot(aPole, aPole));
+	double dLen = atan2(dSin, Dot(aEnd1, aEnd2));
+
+	if (dLen < RADIUS_SLACK || M_PI - dLen < RADIUS_SLACK)
+	{	// A center, or ends too far apart for one great circle
+		AddPiece(piece, 0.0);
+		if (dLen >= RADIUS_SLACK)
+		{
+			piece.dLat1 = piece.dLat2 = rArea.dLat2;
+			piece.dLon1 = piece.dLon2 = rArea.dLon2;
+			AddPiece(piece, 0.0);
+		}
+		return;
+	}
+
+	int i;
+	for (i=0; i<3; i++)
+	{
+		aPole[i] /= dSin;
+		piece.aPole[i] = aPole[i];
+	}
+	piece.bCenter = 0;
+
+	// Points along the great circle, with the given ends kept as they
+	// were for CheckRadius
+	int nPieces = (int)ceil(dLen / (AREA_PIECE_DEG * RAD_PER_DEG));
+	int k;
+	for (k=1; k<=nPieces; k++)
+	{
+		memcpy(piece.aEnd1, k == 1 ? aEnd1 : piece.aEnd2,
+			sizeof(piece.aEnd1));
+		piece.dLat1 = piece.dLat2;
+		piece.dLon1 = piece.dLon2;
+
+		if (k == nPieces)
+		{
+			memcpy(piece.aEnd2, aEnd2, sizeof(piece.aEnd2));
+			piece.dLat2 = rArea.dLat2;
+			piece.dLon2 = rArea.dLon2;
+		}
+		else
+		{
+			double dPart = dLen * k / nPieces;
+			double dWeight1 = sin(dLen - dPart) / dSin;
+			double dWeight2 = sin(dPart) / dSin;
+
+			for (i=0; i<3; i++)
+			{
+				piece.aEnd2[i] = dWeight1 * aEnd1[i] +
+					dWeight2 * aEnd2[i];
+			}
+
+			piece.dLat2 = asin(piece.aEnd2[2] /
+				sqrt(Dot(piece.aEnd2, piece.aEnd2))) /
+				RAD_PER_DEG;
+			piece.dLon2 = atan2(piece.aEnd2[1], piece.aEnd2[0]) /
+				RAD_PER_DEG;
+		}
+
+		AddPiece(piece, dLen / nPieces);
+	}
+}
+
+long CWPFilter::AreaRow(double dLat)
+{
+	long nRow = (long)floor((dLat + 90) / m_dAreaCell);
+	if (nRow < 0)
+		nRow = 0;
+	else if (nRow >= m_nAreaRows)
+		nRow = m_nAreaRows - 1;
+
+	return nRow;
+}
+
+long CWPFilter::AreaCol(double dLon)
+{
+	double dPos = fmod(dLon + 180, 360);
+	if (dPos < 0)
+		dPos += 360;
+
+	long nCol = (long)(dPos / m_dAreaCell);
+	if (nCol >= m_nAreaCols)
+		nCol = m_nAreaCols - 1;
+
+	return nCol;
+}
+
+// Enters a piece in the cells that cover the box around one of its ends
+void CWPFilter::AddAreaCells(int nPiece, double dLat, double dLon,
+	double dReach)
+{
+	double dLatSpan, dLonSpan;
+	RadiusBox(dLat, dReach, dLatSpan, dLonSpan);
+
+	stAreaCell cell;
+	cell.nPiece = nPiece;
+
+	long nRow, nLastRow = AreaRow(dLat + dLatSpan);
+	for (nRow=AreaRow(dLat - dLatSpan); nRow<=nLastRow; nRow++)
+	{
+		long nBase = nRow * m_nAreaCols;
+		long nCol, nFirstCol = 0, nLastCol = m_nAreaCols - 1;
+
+		if (dLonSpan < 180.0)
+		{
+			nFirstCol = AreaCol(dLon - dLonSpan);
+			nLastCol = AreaCol(dLon + dLonSpan);
+		}
+
+		// Across the 180th meridian, the columns wrap around
+		if (nFirstCol > nLastCol)
+			nLastCol += m_nAreaCols;
+
+		for (nCol=nFirstCol; nCol<=nLastCol; nCol++)
+		{
+			cell.nCell = nBase + nCol % m_nAreaCols;
+			m_AreaGrid.push_back(cell);
+		}
+	}
+}
+
+// Whether a point is within the distance of a piece.  Alongside the
+// piece, that is the distance from its great circle; elsewhere it's
+// the distance from the nearer end.
+int CWPFilter::NearPiece(stAreaPiece &rPiece, double dLat, double dLon,
+	double *pVec)
+{
+	if (!rPiece.bCenter)
+	{
+		double aCross[3];
+
+		Cross(rPiece.aEnd1, pVec, aCross);
+		if (Dot(aCross, rPiece.aPole) >= 0)
+		{
+			Cross(pVec, rPiece.aEnd2, aCross);
+			if (Dot(aCross, rPiece.aPole) >= 0)
+			{
+				return (fabs(Dot(pVec, rPiece.aPole)) <=
+					rPiece.dSinDist);
+			}
+		}
+
+		if (CheckRadius(rPiece.dLat2, rPiece.dLon2, dLat, dLon,
+				rPiece.dDist))
+			return 1;
+	}
+
+	return CheckRadius(rPiece.dLat1, rPiece.dLon1, dLat, dLon,
+		rPiece.dDist);
+}
+
+int CWPFilter::InAreas(CWPData *pWP)
+{
+	double aVec[3];
+	int i, nCount = m_Pieces.size();
+
+	if (!pWP->HasPosition())
+	{
+		ToVector(pWP->m_dLat, pWP->m_dLon, aVec);
+		for (i=0; i<nCount; i++)
+		{
+			if (NearPiece(m_Pieces[i], pWP->m_dLat, pWP->m_dLon,
+					aVec))
+				return 1;
+		}
+
+		return 0;
+	}
+
+	stAreaCell key;
+	key.nCell = AreaRow(pWP->m_dLat) * m_nAreaCols +
+		AreaCol(pWP->m_dLon);
+	key.nPiece = -1;
+
+	// Only route pieces need the point as a vector
+	int bVector = 0;
+
+	AreaGrid::iterator iter = lower_bound(m_AreaGrid.begin(),
+		m_AreaGrid.end(), key, AreaCellLess);
+	while (iter != m_AreaGrid.end() && iter->nCell == key.nCell)
+	{
+		stAreaPiece &rPiece = m_Pieces[iter->nPiece];
+		if (!rPiece.bCenter && !bVector)
+		{
+			ToVector(pWP->m_dLat, pWP->m_dLon, aVec);
+			bVector = 1;
+		}
+
+		if (NearPiece(rPiece, pWP->m_dLat, pWP->m_dLon, aVec))
+			return 1;
+
+		iter++;
+	}
+
+	return 0;
+}
+#endif
+
+CStringMatcher::CStringMatcher()
+{
+	m_bSet = 0;
+}
+
+int CStringMatcher::AddState()
+{
+	int nState = m_bFinal.size();
+	m_Next.resize(m_Next.size() + 256, 0);
+	m_bFinal.push_back(0);
+	return nState;
+}
+
+void CStringMatcher::Compile(const string &rFilter)
+{
+	int i, ch;
+
+	m_bSet = !rFilter.empty();
+	m_Next.clear();
+	m_bFinal.clear();
+	AddState();
+
+	// Lowercased strings go into a trie.  An empty one ends the list
+	// (nothing after it was ever checked).
+	size_t nStart = 0;
+	for (;;)
+	{
+		size_t nEnd = rFilter.find(':', nStart);
+		if (nEnd == string::npos)
+			nEnd = rFilter.size();
+		if (nEnd == nStart)
+			break;
+
+		int nState = 0;
+		for (i=nStart; i<(int)nEnd; i++)
+		{
+			ch = (unsigned char)rFilter[i];
+			if (ch >= 'A' && ch <= 'Z')
+				ch = ch - 'A' + 'a';
+
+			// State 0 is never the target of a trie edge
+			if (!m_Next[nState*256 + ch])
+			{
+				int nNew = AddState();
+				m_Next[nState*256 + ch] = nNew;
+			}
+			nState = m_Next[nState*256 + ch];
+		}
+		m_bFinal[nState] = 1;
+
+		if (nEnd == rFilter.size())
+			break;
+		nStart = nEnd + 1;
+	}
+
+	// Fill in the missing moves breadth first, from the state the
+	// longest proper suffix leads to
+	int nStates = m_bFinal.size();
+	vector<int> fail(nStates, 0);
+	vector<int> order;
+	order.reserve(nStates);
+
+	for (ch=0; ch<256; ch++)
+	{
+		if (m_Next[ch])
+			order.push_back(m_Next[ch]);
+	}
+
+	for (i=0; i<(int)order.size(); i++)
+	{
+		int nState = order[i];
+		int nFail = fail[nState];
+		if (m_bFinal[nFail])
+			m_bFinal[nState] = 1;
+
+		for (ch=0; ch<256; ch++)
+		{
+			int &rNext = m_Next[nState*256 + ch];
+			if (rNext)
+			{
+				fail[rNext] = m_Next[nFail*256 + ch];
+				order.push_back(rNext);
+			}
+			else
+				rNext = m_Next[nFail*256 + ch];
+		}
+	}
+
+	// Capitals move like the lowercase letters
+	for (i=0; i<nStates; i++)
+	{
+		for (ch='A'; ch<='Z'; ch++)
+			m_Next[i*256 + ch] = m_Next[i*256 + ch - 'A' + 'a'];
+	}
+}
+
+// Whether any of the strings occurs in rStr (always, with no filter)
+int CStringMatcher::Matches(const string &rStr) const
+{
+	if (!m_bSet)
+		return 1;
+
+	const int *pNext = &m_Next[0];
+	const char *pFinal = &m_bFinal[0];
+	const unsigned char *p = (const unsigned char*)rStr.data();
+	const unsigned char *pEnd = p + rStr.size();
+	int nState = 0;
+
+	while (p < pEnd)
+	{
+		nState = pNext[nState*256 + *p++];
+		if (pFinal[nState])
+			return 1;
+	}
+
+	return 0;
+}
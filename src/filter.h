@@ -0,0 +1,213 @@
+/*
+    Copyright 2003-2010 Brian Smith (brian@smittyware.com)
+    This file is part of CMConvert.
+
+    CMConvert is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    CMConvert is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with CMConvert; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+*/
+
+#ifndef _FILTER_H_INCLUDED_
+#define _FILTER_H_INCLUDED_
+
+#include <list>
+#include <unordered_set>
+typedef list<string> StringList;
+typedef unordered_set<string> StringSet;
+
+class CWPData;
+class CWPList;
+
+#ifndef M_PI
+#define M_PI 3.14159265358979323846
+#endif
+
+// Degrees to radians, as the distance filter has always rounded it
+#define RAD_PER_DEG 0.017453293
+// Allowance for rounding when bounding the distance filter
+#define RADIUS_SLACK 1e-6
+// How far (relative, then absolute) from the limit a batch haversine
+// has to be for its answer to stand without CheckRadius
+#define BATCH_SLACK_REL 1e-9
+#define BATCH_SLACK_ABS 1e-14
+
+// Case-insensitive search for any of the colon-separated strings of a
+// filter, compiled into an Aho-Corasick automaton.  Every state has a
+// move for every byte (both cases of a letter go to the same place),
+// so a search is one table lookup per character.
+class CStringMatcher
+{
+public:
+	CStringMatcher();
+
+	void Compile(const string &rFilter);
+	int Matches(const string &rStr) const;
+
+	// Whether a filter was given at all
+	int IsSet() const { return m_bSet; }
+
+private:
+	int m_bSet;
+	vector<int> m_Next;	// 256 moves per state
+	vector<char> m_bFinal;
+
+	int AddState();
+};
+
+// Coordinates (in degrees) for the batch distance test, in columns,
+// and the haversines of their distances from the center
+#define RADIUS_BLOCK 64
+typedef struct
+{
+	double dLat[RADIUS_BLOCK];
+	double dLon[RADIUS_BLOCK];
+	double dHav[RADIUS_BLOCK];
+} stCoordBlock;
+
+// A center (both ends the same) or a segment of a route for the
+// distance filters beyond a single radius
+typedef struct
+{
+	double dLat1, dLon1;	// Degrees
+	double dLat2, dLon2;
+	double dDist;		// Radians
+} stArea;
+typedef vector<stArea> AreaList;
+
+// Segments are cut into pieces no longer than AREA_PIECE_DEG, so that
+// a box around the ends of a piece holds all that is near it
+#define AREA_PIECE_DEG 1.0
+typedef struct
+{
+	double dLat1, dLon1;
+	double dLat2, dLon2;
+	double dDist;
+	double dSinDist;
+	double dReach;		// Distance from an end that covers it all
+	int bCenter;
+	double aEnd1[3];	// Ends and pole of the great circle through
+	double aEnd2[3];	// them, as unit vectors
+	double aPole[3];
+} stAreaPiece;
+typedef vector<stAreaPiece> AreaPieceList;
+
+// Grid over the pieces, as sorted cell/piece pairs.  Cells are at
+// least AREA_CELL_MIN degrees, and no smaller than the boxes of the
+// pieces, so a piece reaches into few of them.
+#define AREA_CELL_MIN 0.5
+typedef struct
+{
+	long nCell;
+	int nPiece;
+} stAreaCell;
+typedef vector<stAreaCell> AreaGrid;
+
+// Waypoint filters given on the command line
+class CWPFilter
+{
+public:
+	CWPFilter();
+
+	StringSet m_Waypoints;
+	int m_bFilterBugs;
+	int m_bSymFound;
+	int m_bSymNotFound;
+	int m_bFiltActive;
+	int m_bFiltInactive;
+	string m_sContFilt;
+	string m_sCountryFilt;
+	string m_sStateFilt;
+	string m_sTypeFilt;
+	string m_sSymFilt;
+	string m_sOwnerFilt;
+	string m_sExcludeFilt;
+
+	// Center and radius (in radians) of the distance filter
+	int m_bRadius;
+	double m_dLat;
+	double m_dLon;
+	double m_dDist;
+
+	// Must be called once the filters are set, before any matching
+	void Compile();
+#ifdef HAVE_LIBM
+	// Checks the distance filter for a whole list at once, through
+	// its grid (what Matches then goes by)
+	void MarkInRadius(CWPList *pList);
+
+	// Centers and route segments of further distance filters, of
+	// which a waypoint has to be near any one (a segment with the
+	// same ends is a center)
+	void AddArea(double dLat1, double dLon1, double dLat2,
+		double dLon2, double dDist);
+	void ClearAreas();
+#endif
+
+	int IsActive();
+	int Matches(CWPData *pWP, int bFinal);
+
+	static int CheckRadius(double dLat1, double dLon1, double dLat2,
+		double dLon2, double dDist);
+
+private:
+	CStringMatcher m_ContMatch;
+	CStringMatcher m_CountryMatch;
+	CStringMatcher m_StateMatch;
+	CStringMatcher m_TypeMatch;
+	CStringMatcher m_SymMatch;
+	CStringMatcher m_OwnerMatch;
+	CStringMatcher m_ExcludeMatch;
+
+	// Box (in degrees) around the center of the distance filter that
+	// holds every point within the radius, if there is one that
+	// doesn't take in a pole
+	int m_bRadiusBox;
+	double m_dLatSpan;
+	double m_dLonSpan;
+	int m_bRadiusMarked;
+
+	// Center of the distance filter in radians with its cosine, and
+	// the band around the haversine of the radius (sin^2 of half of
+	// it) where the batch test leaves the answer to CheckRadius
+	int m_bRadiusBatch;
+	double m_dCenterLat;
+	double m_dCenterLon;
+	double m_dCenterCos;
+	double m_dHavInside;
+	double m_dHavOutside;
+
+	// Centers and segments as given, and the index over their pieces
+	AreaList m_Areas;
+	AreaPieceList m_Pieces;
+	AreaGrid m_AreaGrid;
+	double m_dAreaCell;
+	long m_nAreaRows;
+	long m_nAreaCols;
+
+	int InRadius(CWPData *pWP);
+	void HaversineBlock(stCoordBlock &rBlock);
+	void MarkBlock(stCoordBlock &rBlock, CWPData **pWPs, int nCount);
+
+	void CompileAreas();
+	void SplitArea(stArea &rArea);
+	void AddPiece(stAreaPiece &rPiece, double dLen);
+	void AddAreaCells(int nPiece, double dLat, double dLon,
+		double dReach);
+	long AreaRow(double dLat);
+	long AreaCol(double dLon);
+	int InAreas(CWPData *pWP);
+	int NearPiece(stAreaPiece &rPiece, double dLat, double dLon,
+		double *pVec);
+};
+
+#endif // _FILTER_H_INCLUDED_
@@ -0,0 +1,158 @@
+/*
+    Copyright 2003-2010 Brian Smith (brian@smittyware.com)
+    This file is part of CMConvert.
+
+    CMConvert is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    CMConvert is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with CMConvert; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+*/
+
+#include "common.h"
+#include "gpxsplit.h"
+
+CGPXSplitter::CGPXSplitter(const char *pData, long nLen)
+{
+	m_pData = pData;
+	m_nLen = nLen;
+	m_nRootEnd = 0;
+}
+
+long CGPXSplitter::FindText(long nPos, const char *szText)
+{
+	int nText = strlen(szText);
+
+	while (nPos < m_nLen)
+	{
+		const char *p = (const char*)memchr(m_pData + nPos, szText[0],
+			m_nLen - nPos);
+		if (!p)
+			break;
+
+		nPos = p - m_pData;
+		if (m_nLen - nPos >= nText && !memcmp(p, szText, nText))
+			return nPos;
+
+		nPos++;
+	}
+
+	return -1;
+}
+
+int CGPXSplitter::FindRoot()
+{
+	long nPos = 0;
+
+	for (;;)
+	{
+		nPos = FindText(nPos, "<");
+		if (nPos < 0 || nPos + 1 >= m_nLen)
+			return 0;
+
+		const char *p = m_pData + nPos + 1;
+		if (*p == '?')
+			nPos = FindText(nPos, "?>");
+		else if (m_nLen - nPos >= 4 && !memcmp(p, "!--", 3))
+			nPos = FindText(nPos, "-->");
+		else if (*p == '!')
+		{	// DOCTYPE; an internal subset is too much bother
+			long nEnd = FindText(nPos, ">");
+			if (nEnd >= 0 && memchr(p, '[', nEnd - nPos))
+				return 0;
+			nPos = nEnd;
+		}
+		else
+			break;
+
+		if (nPos < 0)
+			return 0;
+		nPos++;
+	}
+
+	long nName = nPos + 1;
+	long nEnd = nName;
+	while (nEnd < m_nLen && !strchr(" \t\r\n/>", m_pData[nEnd]))
+		nEnd++;
+
+	string sName(m_pData + nName, nEnd - nName);
+	int nColon = sName.rfind(':');
+	if (sName.substr(nColon + 1) != "gpx")
+		return 0;
+
+	// End of the start tag, skipping over quoted attribute values
+	char chQuote = 0;
+	while (nEnd < m_nLen)
+	{
+		char ch = m_pData[nEnd];
+		if (chQuote)
+		{
+			if (ch == chQuote)
+				chQuote = 0;
+		}
+		else if (ch == '"' || ch == '\'')
+			chQuote = ch;
+		else if (ch == '>')
+			break;
+
+		nEnd++;
+	}
+
+	if (nEnd >= m_nLen || m_pData[nEnd - 1] == '/')
+		return 0;
+
+	m_nRootEnd = nEnd + 1;
+	m_sRootClose = "</" + sName + ">";
+	return 1;
+}
+
+long CGPXSplitter::FindWaypoint(long nPos)
+{
+	// A "<wpt" inside a comment or CDATA section would be taken as a
+	// boundary here, but then the pieces fail to parse and the file is
+	// parsed whole instead
+	while ((nPos = FindText(nPos, "<wpt")) >= 0)
+	{
+		if (nPos + 4 < m_nLen && strchr(" \t\r\n>", m_pData[nPos + 4]))
+			return nPos;
+
+		nPos++;
+	}
+
+	return -1;
+}
+
+int CGPXSplitter::Split(int nParts)
+{
+	m_Points.clear();
+	if (!FindRoot())
+		return 0;
+
+	m_Points.push_back(0);
+
+	int i;
+	for (i=1; i<nParts; i++)
+	{
+		long nTarget = m_nRootEnd +
+			(long)((double)(m_nLen - m_nRootEnd) * i / nParts);
+		if (nTarget <= m_Points.back())
+			nTarget = m_Points.back() + 1;
+
+		long nPos = FindWaypoint(nTarget);
+		if (nPos < 0)
+			break;
+
+		m_Points.push_back(nPos);
+	}
+
+	m_Points.push_back(m_nLen);
+	return (m_Points.size() > 2);
+}
@@ -0,0 +1,51 @@
+/*
+    Copyright 2003-2010 Brian Smith (brian@smittyware.com)
+    This file is part of CMConvert.
+
+    CMConvert is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    CMConvert is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with CMConvert; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+*/
+
+#ifndef _GPXSPLIT_H_INCLUDED_
+#define _GPXSPLIT_H_INCLUDED_
+
+// Finds places to cut a mapped GPX file into pieces that can be parsed
+// separately.  Each piece after the first starts at a top-level <wpt>
+// and is parsed after a copy of the document's root start tag.
+class CGPXSplitter
+{
+public:
+	CGPXSplitter(const char *pData, long nLen);
+
+	// Pick up to nParts pieces; fails if the file has no usable
+	// <gpx> root or no <wpt> to split at
+	int Split(int nParts);
+
+	// Offset just past the root start tag, and the matching end tag
+	long m_nRootEnd;
+	string m_sRootClose;
+
+	// Piece boundaries, from 0 to the file length
+	vector<long> m_Points;
+
+private:
+	const char *m_pData;
+	long m_nLen;
+
+	int FindRoot();
+	long FindWaypoint(long nPos);
+	long FindText(long nPos, const char *szText);
+};
+
+#endif // _GPXSPLIT_H_INCLUDED_
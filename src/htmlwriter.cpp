@@ -61,6 +61,8 @@ int CHTMLWriter::WriteCacheRecord(CWPData *pRec)
 		fprintf(m_fp, "<html><body>\n");
 	}
 
+	pRec->FinishRecord();
+
 	int bWptURL = !pRec->m_sURL.empty();
 	fprintf(m_fp, "<h3><b>%s - ", pRec->m_sWaypoint.c_str());
 	if (bWptURL)
@@ -98,14 +100,21 @@ void CHTMLWriter::WriteFile(string sPdbPath, int bQuiet)
 	typedef vector<string> StringVec;
 	StringVec wps;
 
+	// The first converted record with an ID is the one written for it
+	WPIndex firstWP;
+
 	WPList::iterator iter = m_pList->m_List.begin();
 	while (iter != m_pList->m_List.end())
 	{
 		CWPData *pRec = *iter;
-		if (pRec->m_bConvert && !pRec->m_sLinks.empty())
-			wps.push_back(pRec->m_sWaypoint);
-
 		iter++;
+
+		if (!pRec->m_bConvert)
+			continue;
+
+		firstWP.insert(WPIndex::value_type(pRec->m_sWaypoint, pRec));
+		if (!pRec->m_sLinks.empty())
+			wps.push_back(pRec->m_sWaypoint);
 	}
 
 	sort(wps.begin(), wps.end());
@@ -113,22 +122,8 @@ void CHTMLWriter::WriteFile(string sPdbPath, int bQuiet)
 	StringVec::iterator iter2 = wps.begin();
 	while (iter2 != wps.end())
 	{
-		string sCur = *iter2;
-
-		iter = m_pList->m_List.begin();
-		while (iter != m_pList->m_List.end())
-		{
-			CWPData *pRec = *iter;
-			if (pRec->m_sWaypoint == sCur)
-			{
-				if (!WriteCacheRecord(pRec))
-					return;
-
-				break;
-			}
-
-			iter++;
-		}
+		if (!WriteCacheRecord(firstWP[*iter2]))
+			return;
 
 		iter2++;
 	}
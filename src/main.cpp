@@ -25,18 +25,40 @@
 #include "htmlwriter.h"
 #include "util.h"
 #include "reader.h"
-
-#ifdef HAVE_LIBM
-#include <math.h>
-#endif
+#include "filter.h"
 
 #ifdef HAVE_LOCALE_H
 #include <locale.h>
 #endif
 
+#if HAVE_PTHREAD_H && HAVE_LIBPTHREAD
+#include <pthread.h>
+#endif
+
 #include <list>
 
-typedef list<string> StringList;
+// Waypoints parsed from one input file (or ZIP member), waiting to be
+// merged into the main list
+typedef struct
+{
+	CWPList *pList;
+	string sFileTS;
+	int bLocWarning;
+	int bEmptyDesc;
+	long nLogsSkipped;
+	long nLogBytesSkipped;
+} stParsedFile;
+typedef vector<stParsedFile> ParsedList;
+
+// Input file from the command line
+typedef struct
+{
+	string sFile;
+	int bOpened;
+	int bDone;
+	ParsedList parsed;
+} stInputFile;
+typedef vector<stInputFile> InputList;
 
 static string sOutputPath;
 static string sInputPath;
@@ -45,9 +67,12 @@ static int bListWP, bOwner, bContainer, bDate, bLocation, bShowBugs;
 static int bSymFound, bSymNotFound, bDecodeHints, bFilterBugs, bShowVer;
 static int bQuietMode, nMaxLogs, nMaxDesc, bLogTemplate, bWriteHTML;
 static int bCacheStatus, bFiltActive, bFiltInactive, bUseTS;
-static int bLocWarned, bEmptyWarned, bStripQuotes;
+static int bLocWarned, bEmptyWarned, bStripQuotes, nReadSize, nJobs;
+static int bDeferRecords, bShowStats;
+static long nLogsSkipped, nLogBytesSkipped;
+static CWPFilter wpfilter;
 static string sStateFilt, sCountryFilt, sOwnerFilt, sTypeFilt, sSymFilt,
-	sContFilt, sRadiusFilt, sExcludeFilt;
+	sContFilt, sRadiusFilt, sRouteFilt, sExcludeFilt;
 
 // String filter options...
 static struct option long_options[] = {
@@ -59,15 +84,17 @@ static struct option long_options[] = {
 	{ "sym", 1, 0, 0 },
 	{ "excl", 1, 0, 0 },
 	{ "filter", 1, 0, 0 },
+	{ "wpfile", 1, 0, 0 },
 #ifdef HAVE_LIBM
 	{ "radius", 1, 0, 0 },
+	{ "route", 1, 0, 0 },
 #endif
 	{ 0, 0, 0, 0 }
 };
 static string* filter_str[] = { &sStateFilt, &sCountryFilt, &sContFilt, 
-	&sTypeFilt, &sOwnerFilt, &sSymFilt, &sExcludeFilt, NULL,
+	&sTypeFilt, &sOwnerFilt, &sSymFilt, &sExcludeFilt, NULL, NULL,
 #ifdef HAVE_LIBM
-	&sRadiusFilt
+	&sRadiusFilt, &sRouteFilt
 #endif
 };
 
@@ -93,20 +120,48 @@ string GetDefaultOutputFile(string sPath)
 	return (sOutPath + ".pdb");
 }
 
+// Each radius and route given adds to the places a waypoint can be
+// near, the same as strings add to the other filters
 void AddFilterString(int nIndex, string sStr)
 {
-	bool bRad = (filter_str[nIndex] == &sRadiusFilt);
-
 	string &rStr = *(filter_str[nIndex]);
 	if (!rStr.empty())
+		rStr += ":";
+
+	rStr += sStr;
+}
+
+// Waypoint IDs to select, one per line
+int ReadWaypointFile(string sFile)
+{
+	FILE *fp = fopen(sFile.c_str(), "r");
+	if (!fp)
 	{
-		if (bRad)
-			rStr.erase();
-		else
-			rStr += ":";
+		printf("Can't open waypoint file: %s\n", sFile.c_str());
+		return 0;
 	}
 
-	rStr += sStr;
+	int nCount = 0;
+	char buf[512];
+	while (fgets(buf, 512, fp))
+	{
+		string sLine = buf;
+		CUtil::StripWhitespace(sLine);
+		if (sLine.empty())
+			continue;
+
+		slWaypoints.push_back(sLine);
+		nCount++;
+	}
+
+	if (!bQuietMode)
+	{
+		printf("%d waypoint%s read from: %s\n", nCount, 
+			(nCount == 1) ? "" : "s", sFile.c_str());
+	}
+
+	fclose(fp);
+	return 1;
 }
 
 int ReadFilterFile(string sFile)
@@ -149,7 +204,10 @@ int ReadFilterFile(string sFile)
 			if (nIndex == 7)
 				continue; // Recursion?  Hell no...
 
-			AddFilterString(nIndex, sLine);
+			if (nIndex == 8)
+				ReadWaypointFile(sLine);
+			else
+				AddFilterString(nIndex, sLine);
 			nCount++;
 		}
 
@@ -188,6 +246,7 @@ int ParseCommandLine(int argc, char **argv)
 	bDecodeHints = 0;
 	bFilterBugs = 0;
 	bShowVer = 0;
+	bShowStats = 0;
 	bQuietMode = 0;
 	bLogTemplate = 0;
 	bWriteHTML = 0;
@@ -195,6 +254,8 @@ int ParseCommandLine(int argc, char **argv)
 	bFiltActive = 0;
 	bFiltInactive = 0;
 	bStripQuotes = 0;
+	nReadSize = 0;
+	nJobs = 1;
 	bUseTS = 1;
 
 	slWaypoints.clear();
@@ -209,6 +270,7 @@ int ParseCommandLine(int argc, char **argv)
 	sOwnerFilt.erase();
 	sSymFilt.erase();
 	sRadiusFilt.erase();
+	sRouteFilt.erase();
 	sExcludeFilt.erase();
 
 	if (argc < 2)
@@ -218,7 +280,7 @@ int ParseCommandLine(int argc, char **argv)
 	{
 		int option_index = 0;
 
-		c = getopt_long(argc, argv, "aAbBCdDfFhHlLN:o:OqsStTv",
+		c = getopt_long(argc, argv, "aAbBCdDfFhHj:lLN:o:OqR:sStTvV",
 			long_options, &option_index);
 		if (c == -1)
 			break;
@@ -231,6 +293,11 @@ int ParseCommandLine(int argc, char **argv)
 				if (!ReadFilterFile(optarg))
 					errflg = 1;
 			}
+			else if (option_index == 8)
+			{
+				if (!ReadWaypointFile(optarg))
+					errflg = 1;
+			}
 			else
 				AddFilterString(option_index, optarg);
 			break;
@@ -245,6 +312,14 @@ int ParseCommandLine(int argc, char **argv)
 		case 'F':	bSymNotFound = 1; break;
 		case 'h':	bWriteHTML = 1; break;
 		case 'H':	bDecodeHints = 1; break;
+		case 'j':
+			{
+				char *end;
+				nJobs = strtol(optarg, &end, 10);
+				if (*end != 0 || nJobs < 1)
+					errflg = 1;
+				break;
+			}
 		case 'L':	bLocation = 1; break;
 		case 'l':	bListWP = 1; break;
 		case 'N':
@@ -258,11 +333,44 @@ int ParseCommandLine(int argc, char **argv)
 		case 'O':	bOwner = 1; break;
 		case 'o':	sOutputPath = optarg; break;
 		case 'q':	bQuietMode = 1; break;
+		case 'R':
+			{
+				char *end;
+				long nSize = strtol(optarg, &end, 10);
+				long nScale = 1;
+				if (*end == 'k' || *end == 'K')
+				{
+					nScale = 1024;
+					end++;
+				}
+				else if (*end == 'm' || *end == 'M')
+				{
+					nScale = 1024 * 1024;
+					end++;
+				}
+
+				// Range-check before scaling, so a large count
+				// can't wrap around into range
+				if (*end != 0 || nSize < 0 ||
+						nSize > MAX_CHUNK_SIZE / nScale)
+				{
+					errflg = 1;
+					break;
+				}
+
+				nSize *= nScale;
+				if (nSize < CHUNK_SIZE)
+					errflg = 1;
+				else
+					nReadSize = (int)nSize;
+				break;
+			}
 		case 's':	bStripQuotes = 1; break;
 		case 'S':	bCacheStatus = 1; break;
 		case 'T':	bUseTS = 0; break;
 		case 't':	bLogTemplate = 1; break;
 		case 'v':	bShowVer = 1; break;
+		case 'V':	bShowStats = 1; break;
 		case '?':	errflg = 1; break;
 		}
 	}
@@ -284,21 +392,6 @@ int ParseCommandLine(int argc, char **argv)
 	return 1;
 }
 
-int StringInList(StringList &rList, string &rStr)
-{
-	StringList::iterator iter = rList.begin();
-
-	while (iter != rList.end())
-	{
-		if (*iter == rStr)
-			return 1;
-
-		iter++;
-	}
-
-	return 0;
-}
-
 int PrintVersion()
 {
 	printf(PACKAGE_STRING
@@ -312,14 +405,16 @@ int PrintVersion()
 int PrintUsage(char *szExe)
 {
         printf("Usage: %s [-a] [-A] [-b] [-B] [-C] [-D] [-f] [-F] [-h] [-H]\n"
-	"\t[-l] [-L] [-N max_log_count] [-o output_file] [-O] [-q] [-s] [-S]\n"
-	"\t[-t] [-T] [-v] [--cont=container] [--country=country] [--sym=symbol]\n" 
-	"\t[--state=state] [--owner=cache_owner] [--type=cache_type]\n"
+	"\t[-j jobs] [-l] [-L] [-N max_log_count] [-o output_file] [-O] [-q]\n"
+	"\t[-R read_size] [-s] [-S] [-t] [-T] [-v] [-V] [--cont=container]\n"
+	"\t[--country=country] [--sym=symbol] [--state=state]\n"
+	"\t[--owner=cache_owner] [--type=cache_type]\n"
 #ifdef HAVE_LIBM
 	"\t[--radius=distance,lat,lon] [--radius=distance,waypoint]\n"
+	"\t[--route=distance,point,point...]\n"
 #endif
-	"\t[--excl=waypoint_list] [--filter=file] input_file1[,input_file2...]\n"
-	"\t[waypoint ...]\n",
+	"\t[--excl=waypoint_list] [--filter=file] [--wpfile=file]\n"
+	"\tinput_file1[,input_file2...] [waypoint ...]\n",
 		szExe);
 
 	return 2;
@@ -347,69 +442,75 @@ int CheckPDBStructSizes()
 	return !err;
 }
 
-int check_filter_string(string sFilter, string sCheck)
+#ifdef HAVE_LIBM
+// Distance with its unit (kilometers, statute miles or, by default,
+// nautical miles), in radians of a great circle
+double parse_distance(string sPiece)
 {
-	if (sFilter.empty())
-		return 1;
-	if (sCheck.empty())
-		return 0;
-
-	CUtil::LowercaseString(sCheck);
-	CUtil::LowercaseString(sFilter);
+	string sUnit;
+	char *szUnit;
 
-	int nPos = sFilter.find(':');
-	while (nPos != string::npos)
-	{
-		string sSub = sFilter.substr(0, nPos);
-		sFilter = sFilter.substr(nPos+1);
+	double dDist = strtod(sPiece.c_str(), &szUnit);
+	sUnit = szUnit;
+	CUtil::LowercaseString(sUnit);
 
-		if (sSub.empty())
-			return 0;
-		if (strstr(sCheck.c_str(), sSub.c_str()))
-			return 1;
+	if (sUnit == "k" || sUnit == "km")
+		dDist /= 6378.1370;	// Kilometers
+	else if (sUnit == "mi")
+		dDist /= 3963.37433180;	// Statute miles
+	else
+		dDist /= 3441.6427252;	// Nautical miles
 
-		nPos = sFilter.find(':');
-	}
+	return dDist;
+}
 
-	if (sFilter.empty())
+// Position of a waypoint to measure from, once there's a list to look
+// it up in
+int parse_waypoint_point(string sWP, double &dLat, double &dLon,
+	CWPList *pList)
+{
+	if (!pList)
 		return 0;
-	else if (strstr(sCheck.c_str(), sFilter.c_str()))
-		return 1;
-	else
+
+	CWPData *pWP = pList->GetByWP(sWP);
+	if (!pWP)
+	{
+		printf("Unknown waypoint ID - %s\n", sWP.c_str());
 		return 0;
+	}
+
+	dLat = pWP->m_dLat;
+	dLon = pWP->m_dLon;
+	return 1;
 }
 
-#ifdef HAVE_LIBM
-int parse_radius_filter(double &dLat, double &dLon, double &dDist,
-	CWPList &rList)
+int valid_point(double dLat, double dLon)
+{
+	return (dLat >= -90.0 && dLat <= 90.0 && dLon >= -180.0 &&
+		dLon < 180.0);
+}
+
+// Without a list, only a filter centered on coordinates can be parsed
+int parse_radius_filter(string sSpec, double &dLat, double &dLon,
+	double &dDist, CWPList *pList)
 {
 	int nIndex;
-	string sPiece, sLeft, sUnit;
-	char *szUnit;
+	string sPiece, sLeft;
 
-	nIndex = sRadiusFilt.find(',');
+	nIndex = sSpec.find(',');
 	if (nIndex == string::npos)
 		return 0;
-	sPiece = sRadiusFilt.substr(0, nIndex);
-	sLeft = sRadiusFilt.substr(nIndex+1);
+	sPiece = sSpec.substr(0, nIndex);
+	sLeft = sSpec.substr(nIndex+1);
 	if (sPiece.empty())
 		return 0;
-	dDist = strtod(sPiece.c_str(), &szUnit);
-	sUnit = szUnit;
-	CUtil::LowercaseString(sUnit);
+	dDist = parse_distance(sPiece);
 
 	nIndex = sLeft.find(',');
 	if (nIndex == string::npos)
 	{
-		CWPData *pWP = rList.GetByWP(sLeft);
-		if (!pWP)
-		{
-			printf("Unknown waypoint ID - %s\n", sLeft.c_str());
+		if (!parse_waypoint_point(sLeft, dLat, dLon, pList))
 			return 0;
-		}
-
-		dLat = pWP->m_dLat;
-		dLon = pWP->m_dLon;
 
 		if (!bQuietMode)
 		{
@@ -428,69 +529,192 @@ int parse_radius_filter(double &dLat, double &dLon, double &dDist,
 		dLon = atof(sLeft.c_str());
 	}
 
-	if (sUnit == "k" || sUnit == "km")
-		dDist /= 6378.1370;	// Kilometers
-	else if (sUnit == "mi")
-		dDist /= 3963.37433180;	// Statute miles
-	else
-		dDist /= 3441.6427252;	// Nautical miles
-
-	if (dDist < 0.0 || dLat < -90.0 || dLat > 90.0 || dLon < -180.0 ||
-			dLon >= 180.0)
+	if (dDist < 0.0 || !valid_point(dLat, dLon))
 		return 0;	// Values out of range
 
 	return 1;
 }
 
-int check_radius_filter(double dLat1, double dLon1, double dLat2,
-	double dLon2, double dDist)
+void split_string(string sStr, char cSep, StringList &rPieces)
 {
-	double ddLat, ddLon, a, c;
+	rPieces.clear();
 
-	dLat1 *= 0.017453293;
-	dLon1 *= 0.017453293;
-	dLat2 *= 0.017453293;
-	dLon2 *= 0.017453293;
+	int nIndex = sStr.find(cSep);
+	while (nIndex != string::npos)
+	{
+		rPieces.push_back(sStr.substr(0, nIndex));
+		sStr = sStr.substr(nIndex+1);
+		nIndex = sStr.find(cSep);
+	}
 
-	ddLat = dLat2 - dLat1;
-	ddLon = dLon2 - dLon1;
+	rPieces.push_back(sStr);
+}
 
-	if (ddLat == 0.0 && ddLon == 0.0)
-		return 1;
+int is_number(string &rStr)
+{
+	char *szEnd;
 
-	a = pow(sin(ddLat/2), 2) + cos(dLat1) * cos(dLat2) *
-		pow(sin(ddLon/2), 2);
-	c = 2 * atan2(sqrt(a), sqrt(1-a));
+	if (rStr.empty())
+		return 0;
 
-	return (c <= dDist);
+	strtod(rStr.c_str(), &szEnd);
+	return (*szEnd == 0);
 }
+
+// A route is a distance and two or more points, each a latitude and
+// longitude or a waypoint ID.  Its segments go into the filter.
+int parse_route_filter(string sSpec, CWPList *pList)
+{
+	StringList pieces;
+	split_string(sSpec, ',', pieces);
+
+	StringList::iterator iter = pieces.begin();
+	if (iter->empty())
+		return 0;
+	double dDist = parse_distance(*iter);
+	iter++;
+	if (dDist < 0.0)
+		return 0;
+
+	int nPoints = 0;
+	double dLat, dLon, dPrevLat = 0.0, dPrevLon = 0.0;
+	while (iter != pieces.end())
+	{
+		if (is_number(*iter))
+		{
+			dLat = atof(iter->c_str());
+			iter++;
+			if (iter == pieces.end() || !is_number(*iter))
+				return 0;
+			dLon = atof(iter->c_str());
+		}
+		else if (!parse_waypoint_point(*iter, dLat, dLon, pList))
+			return 0;
+
+		iter++;
+		if (!valid_point(dLat, dLon))
+			return 0;
+
+		if (nPoints)
+		{
+			wpfilter.AddArea(dPrevLat, dPrevLon, dLat, dLon,
+				dDist);
+		}
+
+		dPrevLat = dLat;
+		dPrevLon = dLon;
+		nPoints++;
+	}
+
+	return (nPoints >= 2);
+}
+
+// Sets up the radius and route filters.  A single radius is checked
+// on its own (with the grid of the list, after parsing); more centers
+// or any routes go into the filter as areas, near any of which a
+// waypoint has to be.
+int parse_distance_filters(CWPList *pList)
+{
+	StringList specs;
+	StringList::iterator iter;
+	double dLat = 0.0, dLon = 0.0, dDist = 0.0;
+	int nCenters = 0;
+
+	wpfilter.m_bRadius = 0;
+	wpfilter.ClearAreas();
+
+	if (!sRadiusFilt.empty())
+	{
+		split_string(sRadiusFilt, ':', specs);
+		for (iter=specs.begin(); iter!=specs.end(); iter++)
+		{
+			if (!parse_radius_filter(*iter, dLat, dLon, dDist,
+					pList))
+			{
+				if (pList)
+				{
+					printf("Invalid radius filter "
+						"specification.\n");
+				}
+
+				wpfilter.ClearAreas();
+				return 0;
+			}
+
+			wpfilter.AddArea(dLat, dLon, dLat, dLon, dDist);
+			nCenters++;
+		}
+	}
+
+	if (!sRouteFilt.empty())
+	{
+		split_string(sRouteFilt, ':', specs);
+		for (iter=specs.begin(); iter!=specs.end(); iter++)
+		{
+			if (!parse_route_filter(*iter, pList))
+			{
+				if (pList)
+				{
+					printf("Invalid route filter "
+						"specification.\n");
+				}
+
+				wpfilter.ClearAreas();
+				return 0;
+			}
+		}
+	}
+	else if (nCenters == 1)
+	{
+		wpfilter.ClearAreas();
+		wpfilter.m_bRadius = 1;
+		wpfilter.m_dLat = dLat;
+		wpfilter.m_dLon = dLon;
+		wpfilter.m_dDist = dDist;
+	}
+
+	return 1;
+}
+
 #endif
 
-int parse_xml_file(string sFile, CWPList *pList)
+int parse_xml_file(stInputFile &rInput, int nFileJobs)
 {
 	IXMLReader *pReader;
+	string &sFile = rInput.sFile;
 
 #if HAVE_LIBZ && HAVE_LIBZZIP
 	string sExt = sFile.substr(sFile.size() - 4);
 	CUtil::LowercaseString(sExt);
 	if (sExt == ".zip")
-		pReader = new CZIPReader;
+	{
+		CZIPReader *pZIPReader = new CZIPReader;
+		pZIPReader->m_nJobs = nFileJobs;
+		pReader = pZIPReader;
+	}
 	else
 #endif
+#if HAVE_MMAP && HAVE_SYS_MMAN_H
+		pReader = new CMapReader;
+#else
 		pReader = new CXMLReader;
+#endif
 
 	pReader->m_bQuiet = bQuietMode;
 	if (!pReader->Open(sFile.c_str()))
 	{
 		printf("Couldn't open file: %s\n", sFile.c_str());
+		delete pReader;
 		return 0;
 	}
 
+	rInput.bOpened = 1;
+
 	do
 	{
 		CXMLParser parser;
-		CWPList wplist;
-		parser.m_pList = &wplist;
+		CWPList *pList = new CWPList;
+		parser.m_pList = pList;
 		parser.m_bContainer = bContainer;
 		parser.m_bLocation = bLocation;
 		parser.m_bOwner = bOwner;
@@ -503,10 +727,42 @@ int parse_xml_file(string sFile, CWPList *pList)
 		parser.m_bQuiet = bQuietMode;
 		parser.m_bCacheStatus = bCacheStatus;
 		parser.m_bStripNameQuotes = bStripQuotes;
+		parser.m_nReadSize = nReadSize;
+		parser.m_nJobs = nFileJobs;
+		parser.m_bDeferRecords = bDeferRecords;
+		if (wpfilter.IsActive())
+			parser.m_pFilter = &wpfilter;
 		if (!parser.ParseFile(sFile, pReader))
+		{
+			delete pList;
 			continue;
+		}
+
+		stParsedFile parsed;
+		parsed.pList = pList;
+		parsed.sFileTS = parser.m_sFileTS;
+		parsed.bLocWarning = parser.m_bLocWarning;
+		parsed.bEmptyDesc = parser.m_bEmptyDesc;
+		parsed.nLogsSkipped = parser.m_nLogsSkipped;
+		parsed.nLogBytesSkipped = parser.m_nLogBytesSkipped;
+		rInput.parsed.push_back(parsed);
+	} while (pReader->NextFile());
 
-		if (!bQuietMode && parser.m_bLocWarning && !bLocWarned)
+	pReader->Close();
+	delete pReader;
+
+	return 1;
+}
+
+int merge_xml_file(stInputFile &rInput, CWPList *pList)
+{
+	if (!rInput.bOpened)
+		return 0;
+
+	ParsedList::iterator iter = rInput.parsed.begin();
+	while (iter != rInput.parsed.end())
+	{
+		if (!bQuietMode && iter->bLocWarning && !bLocWarned)
 		{
 			printf(
 		"You are converting one or more Geocaching.com LOC files.  Please be\n"
@@ -515,7 +771,7 @@ int parse_xml_file(string sFile, CWPList *pList)
 			bLocWarned = 1;
 		}
 
-		if (!bQuietMode && parser.m_bEmptyDesc && !bEmptyWarned)
+		if (!bQuietMode && iter->bEmptyDesc && !bEmptyWarned)
 		{
 			printf(
 		"WARNING:  This looks like a geocache GPX file, but is missing\n"
@@ -524,13 +780,136 @@ int parse_xml_file(string sFile, CWPList *pList)
 			bEmptyWarned = 1;
 		}
 
-		string ts = bUseTS ? parser.m_sFileTS : "";
+		nLogsSkipped += iter->nLogsSkipped;
+		nLogBytesSkipped += iter->nLogBytesSkipped;
 
-		pList->AddList(&wplist, ts);
-	} while (pReader->NextFile());
+		string ts = bUseTS ? iter->sFileTS : "";
 
-	pReader->Close();
-	delete pReader;
+		pList->AddList(iter->pList, ts);
+		delete iter->pList;
+		iter->pList = NULL;
+
+		iter++;
+	}
+
+	return 1;
+}
+
+void free_parsed_files(stInputFile &rInput)
+{
+	ParsedList::iterator iter = rInput.parsed.begin();
+	while (iter != rInput.parsed.end())
+	{
+		delete iter->pList;
+		iter++;
+	}
+
+	rInput.parsed.clear();
+}
+
+#if HAVE_PTHREAD_H && HAVE_LIBPTHREAD
+static pthread_mutex_t s_InputLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t s_InputDone = PTHREAD_COND_INITIALIZER;
+static InputList *s_pInputs;
+static int s_nNextInput;
+
+void* parse_worker(void *)
+{
+	for (;;)
+	{
+		pthread_mutex_lock(&s_InputLock);
+		int nIndex = s_nNextInput++;
+		pthread_mutex_unlock(&s_InputLock);
+
+		if (nIndex >= (int)s_pInputs->size())
+			break;
+
+		stInputFile &rInput = (*s_pInputs)[nIndex];
+		parse_xml_file(rInput, 1);
+
+		pthread_mutex_lock(&s_InputLock);
+		rInput.bDone = 1;
+		pthread_cond_broadcast(&s_InputDone);
+		pthread_mutex_unlock(&s_InputLock);
+	}
+
+	return NULL;
+}
+
+// Parse files on a pool of threads, merging them in input order as
+// they finish so the result is the same as a sequential run
+int parse_files_parallel(InputList &rInputs, CWPList *pList)
+{
+	int nThreads = nJobs;
+	if (nThreads > (int)rInputs.size())
+		nThreads = rInputs.size();
+
+	s_pInputs = &rInputs;
+	s_nNextInput = 0;
+
+	vector<pthread_t> threads;
+	int i;
+	for (i=0; i<nThreads; i++)
+	{
+		pthread_t thread;
+		if (pthread_create(&thread, NULL, parse_worker, NULL) == 0)
+			threads.push_back(thread);
+	}
+
+	if (threads.empty())
+		parse_worker(NULL);
+
+	int bSuccess = 1;
+	InputList::iterator iter = rInputs.begin();
+	while (iter != rInputs.end())
+	{
+		pthread_mutex_lock(&s_InputLock);
+		while (!iter->bDone)
+			pthread_cond_wait(&s_InputDone, &s_InputLock);
+		pthread_mutex_unlock(&s_InputLock);
+
+		if (!merge_xml_file(*iter, pList))
+		{	// Stop handing out files
+			pthread_mutex_lock(&s_InputLock);
+			s_nNextInput = rInputs.size();
+			pthread_mutex_unlock(&s_InputLock);
+
+			bSuccess = 0;
+			break;
+		}
+
+		iter++;
+	}
+
+	for (i=0; i<(int)threads.size(); i++)
+		pthread_join(threads[i], NULL);
+
+	for (iter = rInputs.begin(); iter != rInputs.end(); iter++)
+		free_parsed_files(*iter);
+
+	return bSuccess;
+}
+#endif
+
+int parse_files(InputList &rInputs, CWPList *pList)
+{
+#if HAVE_PTHREAD_H && HAVE_LIBPTHREAD
+	if (nJobs > 1 && rInputs.size() > 1)
+		return parse_files_parallel(rInputs, pList);
+#endif
+
+	// A single file can be split among the threads instead
+	int nFileJobs = (rInputs.size() == 1) ? nJobs : 1;
+
+	InputList::iterator iter = rInputs.begin();
+	while (iter != rInputs.end())
+	{
+		parse_xml_file(*iter, nFileJobs);
+		if (!merge_xml_file(*iter, pList))
+			return 0;
+
+		iter++;
+	}
 
 	return 1;
 }
@@ -561,7 +940,38 @@ int main(int argc, char **argv)
 
 	bLocWarned = 0;
 
-	CWPList wplist;
+	// Records only need converting once the filters have passed them
+	wpfilter.m_Waypoints.clear();
+	wpfilter.m_Waypoints.insert(slWaypoints.begin(), slWaypoints.end());
+	wpfilter.m_bFilterBugs = bFilterBugs;
+	wpfilter.m_bSymFound = bSymFound;
+	wpfilter.m_bSymNotFound = bSymNotFound;
+	wpfilter.m_bFiltActive = bFiltActive;
+	wpfilter.m_bFiltInactive = bFiltInactive;
+	wpfilter.m_sContFilt = sContFilt;
+	wpfilter.m_sCountryFilt = sCountryFilt;
+	wpfilter.m_sStateFilt = sStateFilt;
+	wpfilter.m_sTypeFilt = sTypeFilt;
+	wpfilter.m_sSymFilt = sSymFilt;
+	wpfilter.m_sOwnerFilt = sOwnerFilt;
+	wpfilter.m_sExcludeFilt = sExcludeFilt;
+
+#ifdef HAVE_LIBM
+	// Distances from given coordinates can be checked while parsing
+	if (!sRadiusFilt.empty() || !sRouteFilt.empty())
+		parse_distance_filters(NULL);
+#endif
+	wpfilter.Compile();
+
+	// Records only need converting once the filters have passed them
+	bDeferRecords = bListWP || wpfilter.IsActive() ||
+		!sRadiusFilt.empty() || !sRouteFilt.empty();
+
+	InputList inputs;
+	stInputFile input;
+	input.bOpened = 0;
+	input.bDone = 0;
+
 	int nComma = sInputPath.find(',');
 	while (nComma != string::npos)
 	{
@@ -570,8 +980,8 @@ int main(int argc, char **argv)
 
 		if (!sFile.empty())
 		{
-			if (!parse_xml_file(sFile, &wplist))
-				return 1;
+			input.sFile = sFile;
+			inputs.push_back(input);
 		}
 
 		nComma = sInputPath.find(',');
@@ -579,81 +989,70 @@ int main(int argc, char **argv)
 
 	if (!sInputPath.empty())
 	{
-		if (!parse_xml_file(sInputPath, &wplist))
-			return 1;
+		input.sFile = sInputPath;
+		inputs.push_back(input);
+	}
+
+	CWPList wplist;
+	nLogsSkipped = nLogBytesSkipped = 0;
+	if (!parse_files(inputs, &wplist))
+		return 1;
+
+	if (bShowStats && !bQuietMode)
+	{
+		printf("Cache logs skipped past the limit: %ld"
+			" (%ld bytes parsed)\n", nLogsSkipped, nLogBytesSkipped);
 	}
 
 	// Apply filters to waypoint records
 
 #ifdef HAVE_LIBM
-	double dLat, dLon, dDist;
-	int bRadius = 0;
-
-	if (!sRadiusFilt.empty())
+	if (!sRadiusFilt.empty() || !sRouteFilt.empty())
 	{
-		bRadius = parse_radius_filter(dLat, dLon, dDist, wplist);
-		if (!bRadius)
-		{
-			printf("Invalid radius filter specification.\n");
+		if (!parse_distance_filters(&wplist))
 			return 2;
-		}
+
+		wpfilter.Compile();
+		if (wpfilter.m_bRadius)
+			wpfilter.MarkInRadius(&wplist);
 	}
 #endif
 
-	int bAll = (slWaypoints.size() == 0);
-	WPList::iterator iter = wplist.m_List.begin();
-	while (iter != wplist.m_List.end())
+	// When waypoints are named, only their records are looked at,
+	// as found through the index of the list
+	WPList selected;
+	WPList *pCheck = &wplist.m_List;
+	WPList::iterator iter;
+
+	if (!wpfilter.m_Waypoints.empty())
 	{
-		CWPData *pData = (*iter);
-		
-		if (bAll || StringInList(slWaypoints, pData->m_sWaypoint))
-			pData->m_bConvert = 1;
-
-		// Travel bug filter
-		if (bFilterBugs && !pData->m_bTravelBugs)
-			pData->m_bConvert = 0;
-
-		// Found/not found filter
-		if (bSymFound && (pData->m_sSymbol != "Geocache Found"))
-			pData->m_bConvert = 0;
-		if (bSymNotFound && (pData->m_sSymbol != "Geocache"))
-			pData->m_bConvert = 0;
-
-		// Cache active/inactive filter
-		if (bFiltActive && !pData->m_bActive)
-			pData->m_bConvert = 0;
-		if (bFiltInactive && pData->m_bActive)
-			pData->m_bConvert = 0;
-
-		// String filters
-		if (!check_filter_string(sContFilt, pData->m_sContainer))
-			pData->m_bConvert = 0;
-		if (!check_filter_string(sCountryFilt, pData->m_sCountry))
-			pData->m_bConvert = 0;
-		if (!check_filter_string(sStateFilt, pData->m_sState))
-			pData->m_bConvert = 0;
-		if (!check_filter_string(sTypeFilt, pData->m_sType))
-			pData->m_bConvert = 0;
-		if (!check_filter_string(sSymFilt, pData->m_sSymbol))
-			pData->m_bConvert = 0;
-		if (!check_filter_string(sOwnerFilt, pData->m_sOwner))
-			pData->m_bConvert = 0;
-
-		if (!sExcludeFilt.empty())
-		{
-			if (check_filter_string(sExcludeFilt,
-					pData->m_sWaypoint))
-				pData->m_bConvert = 0;
-		}
+		for (iter=wplist.m_List.begin(); iter!=wplist.m_List.end();
+				iter++)
+			(*iter)->m_bConvert = 0;
 
-#ifdef HAVE_LIBM
-		if (bRadius)
+		StringSet::iterator iterWP = wpfilter.m_Waypoints.begin();
+		while (iterWP != wpfilter.m_Waypoints.end())
 		{
-			if (!check_radius_filter(dLat, dLon, pData->m_dLat,
-					pData->m_dLon, dDist))
-				pData->m_bConvert = 0;
+			wplist.FindByWP(*iterWP, selected);
+			iterWP++;
 		}
-#endif
+
+		pCheck = &selected;
+	}
+
+	iter = pCheck->begin();
+	while (iter != pCheck->end())
+	{
+		CWPData *pData = (*iter);
+
+		// Waypoints the parser already filtered out have no record
+		pData->m_bConvert = !pData->m_bFiltered &&
+			wpfilter.Matches(pData, 1);
+
+		// Finish the conversion of waypoints that are kept (a
+		// quiet listing doesn't look at the records)
+		if (pData->m_bConvert && (!bListWP || !bQuietMode))
+			pData->FinishRecord();
 
 		iter++;
 	}
@@ -20,8 +20,15 @@
 #include "common.h"
 #include "parser.h"
 #include "reader.h"
+#include "charref.h"
+#include "gpxsplit.h"
+#include "ring.h"
 #include "util.h"
 
+#if HAVE_PTHREAD_H && HAVE_LIBPTHREAD
+#include <pthread.h>
+#endif
+
 extern "C" {
 #include <expat.h>
 }
@@ -45,6 +52,10 @@ extern "C" {
 #define FF_GPX_VERSION	32768	// GPX version attribute
 #define FF_CACHE_ATTR	65536	// GC.com cache attribute
 
+// Flags whose handling uses the element's character data
+#define FF_USES_DATA	(FF_TIMESTAMP | FF_WPT_URL | FF_BUG_NAME | \
+	FF_CACHE_ATTR)
+
 // Geocaching.com.au GPX extensions
 static stPathMap s_AUMap[] = {
   { "", -1, FF_CACHE_STATUS },
@@ -148,6 +159,9 @@ static stPathMap s_BaseMap[] = {
   { NULL, 0, 0 }
 };
 
+// All of the above, compiled into a path automaton at startup
+static const CPathTrie s_PathTrie(s_BaseMap, s_ExtMap);
+
 CXMLParser::CXMLParser()
 {
 	m_bDate = 0;
@@ -161,6 +175,15 @@ CXMLParser::CXMLParser()
 	m_bLogTemplate = 0;
 	m_bQuiet = 0;
 	m_bStripNameQuotes = 0;
+	m_nReadSize = 0;
+	m_nJobs = 1;
+	m_bDeferRecords = 0;
+	m_pFilter = NULL;
+	m_bFilterLate = 0;
+	m_nLogsSkipped = 0;
+	m_nLogBytesSkipped = 0;
+	m_nSkipDepth = 0;
+	m_nSkipStart = 0;
 
 	m_nCurLogs = 0;
 	m_bHasBugs = 0;
@@ -172,27 +195,43 @@ CXMLParser::CXMLParser()
 	m_bLongDesc = 0;
 	m_dGpxVer = 0;
 	m_pExtensions = NULL;
+	m_pExpat = NULL;
 	m_bInclAttr = 0;
 	m_bHtmlFlag = 0;
-
-	m_sCurPath.erase();
+	m_nPathSet = 0;
+	m_bFileTSSet = 0;
+	m_bExtMissed = 0;
+	m_nRecords = 0;
+	m_bFirstNonCache = 0;
+	m_bFirstLongDesc = 0;
+	m_pDeferred = NULL;
+
+	m_nCurNode = PATH_ROOT;
+	m_nDepth = 0;
+	m_bCapture = 0;
 	m_sFileTS.erase();
 
 	ClearWaypoint();
 }
 
+CXMLParser::~CXMLParser()
+{
+	delete m_pDeferred;
+}
+
 void CXMLParser::CheckForGPXExtensions(const char **attr)
 {
 	if (m_dGpxVer < 1.0)
 		return;
 
-	int bFound = 0;
 	for (int i=0; attr[i]; i+=2)
 	{
-		string sName = attr[i], sVal = attr[i+1];
-		if (sName != "xmlns" && sName.substr(0,6) != "xmlns:")
+		const char *szName = attr[i];
+		if (strncmp(szName, "xmlns", 5) != 0 ||
+				(szName[5] && szName[5] != ':'))
 			continue;
 
+		string sVal = attr[i+1];
 		CUtil::LowercaseString(sVal);
 
 		stExtMap *pExt = s_ExtMap;
@@ -201,32 +240,22 @@ void CXMLParser::CheckForGPXExtensions(const char **attr)
 			if (pExt->bPrefix)
 			{
 				if (sVal.substr(0, strlen(pExt->szURI)) ==
-					pExt->szURI)
-				{
-					m_pExtensions = pExt;
-					bFound = 1;
+						pExt->szURI)
 					break;
-				}
 			}
 			else if (sVal == pExt->szURI)
-			{
-				m_pExtensions = pExt;
-				bFound = 1;
 				break;
-			}
 
 			pExt++;
 		}
 
-		if (bFound)
+		if (pExt->szURI)
+		{
+			m_pExtensions = pExt;
+			m_nPathSet = CPathTrie::ExtensionSet(
+				m_pExtensions - s_ExtMap, (m_dGpxVer > 1.0));
 			break;
-	}
-
-	if (bFound)
-	{
-		m_sExtBase = (m_dGpxVer > 1.0) ? "/gpx/wpt/extensions" : 
-			"/gpx/wpt";
-		m_sExtBase += m_pExtensions->szExtElem;
+		}
 	}
 }
 
@@ -245,74 +274,65 @@ void CXMLParser::GetAttribute(const char **attr, string sName, string &sVal)
 	}
 }
 
-int CXMLParser::GetElementInfo(string sPath, int &rField, int32_t &rFlags)
+int CXMLParser::GetElementInfo(int nNode, int &rField, int32_t &rFlags)
 {
-	stPathMap *pField;
-
-	// Check base field map
-	pField = s_BaseMap;
-	while (pField->szName)
-	{
-		if (sPath == pField->szName)
-		{
-			rField = pField->nField;
-			rFlags = pField->nFlags;
-			return 1;
-		}
-
-		pField++;
+	// Extensions only apply once they have been discovered
+	const stPathMap *pField = s_PathTrie.Lookup(nNode,
+		m_pExtensions ? m_nPathSet : 0);
+	if (!pField)
+	{	// Note paths an extension found earlier in the file would map
+		if (!m_pExtensions && s_PathTrie.HasExtension(nNode))
+			m_bExtMissed = 1;
+		return 0;
 	}
 
-	if (!m_pExtensions)
-		return 0;	// No extensions discovered... yet
-
-	if (sPath.substr(0, m_sExtBase.size()) != m_sExtBase)
-		return 0;	// Base path doesn't match
-
-	// Check extension field map
-	pField = m_pExtensions->pMap;
-	while (pField->szName)
-	{
-		string sCheck = m_sExtBase;
-		sCheck += pField->szName;
+	rField = pField->nField;
+	rFlags = pField->nFlags;
+	return 1;
+}
 
-		if (sPath == sCheck)
-		{
-			rField = pField->nField;
-			rFlags = pField->nFlags;
-			return 1;
-		}
+int CXMLParser::WantsCharData(int nNode)
+{
+	int nField;
+	int32_t nFlags;
 
-		pField++;
-	}
+	if (!GetElementInfo(nNode, nField, nFlags))
+		return 0;
+	if (m_bSkipWaypoint && IsDeferredField(nField))
+		return 0;
 
-	return 0;
+	return (nField != -1 || (nFlags & FF_USES_DATA));
 }
 
 void CXMLParser::HandleElemStart(void *data, const char *el, const char **attr)
 {
 	CXMLParser *pParser = (CXMLParser*)data;
 
-	string elem = el;
-	int pos = elem.find(':');
-	if (pos != string::npos)
-		elem = elem.substr(pos+1);
-
-	pParser->m_sCurTag = elem;
 	pParser->m_sCurData.erase();
-	pParser->m_sCurPath += '/';
-	pParser->m_sCurPath += elem;
+
+	// Paths deeper than the stack can't be in any map
+	int nNode = pParser->m_nCurNode;
+	if (pParser->m_nDepth < MAX_PATH_DEPTH)
+		pParser->m_aNodeStack[pParser->m_nDepth] = nNode;
+	pParser->m_nDepth++;
+
+	if (nNode != PATH_NONE)
+	{
+		const char *szLocal = strchr(el, ':');
+		szLocal = szLocal ? (szLocal + 1) : el;
+		nNode = s_PathTrie.Step(nNode,
+			s_PathTrie.InternName(szLocal));
+	}
+	pParser->m_nCurNode = nNode;
 
 	if (!pParser->m_pExtensions)
 		pParser->CheckForGPXExtensions(attr);
 
 	int bData, nField;
 	int32_t nFlags;
-	bData = pParser->GetElementInfo(pParser->m_sCurPath, nField, nFlags);
-	if (!bData)
-		return;
+	bData = pParser->GetElementInfo(nNode, nField, nFlags);
 
-	if (nFlags & FF_GPX_VERSION)
+	if (bData && (nFlags & FF_GPX_VERSION))
 	{
 		string sVer;
 		GetAttribute(attr, "version", sVer);
@@ -323,6 +343,30 @@ void CXMLParser::HandleElemStart(void *data, const char *el, const char **attr)
 			pParser->CheckForGPXExtensions(attr);
 	}
 
+	// Once the descriptions start, everything the filters look at
+	// (other than travel bugs) is known
+	if (bData && pParser->m_pDeferred && pParser->m_pFilter &&
+			!pParser->m_bFilterChecked &&
+			(IsDeferredField(nField) || (nFlags & FF_LOG_ELEM)))
+		pParser->CheckFilter();
+
+	// Nothing inside a log past the limit maps to a field
+	if (bData && (nFlags & FF_LOG_ELEM) && pParser->CanSkipCacheLog())
+	{
+		pParser->m_nCurNode = PATH_NONE;
+		pParser->m_bCapture = 0;
+		pParser->m_nSkipDepth = pParser->m_nDepth;
+		pParser->m_nSkipStart =
+			(long)XML_GetCurrentByteIndex(pParser->m_pExpat);
+		return;
+	}
+
+	pParser->m_bCapture = bData &&
+		(nField != -1 || (nFlags & FF_USES_DATA)) &&
+		!(pParser->m_bSkipWaypoint && IsDeferredField(nField));
+	if (!bData)
+		return;
+
 	if (nFlags & FF_REC_ELEM)
 		pParser->ClearWaypoint();
 
@@ -356,18 +400,19 @@ void CXMLParser::HandleElemStart(void *data, const char *el, const char **attr)
 	{
 		GetAttribute(attr, "lat", pParser->m_sFields[FLD_LOG_LAT]);
 		GetAttribute(attr, "lon", pParser->m_sFields[FLD_LOG_LON]);
+		pParser->DeferField(FLD_LOG_LAT);
+		pParser->DeferField(FLD_LOG_LON);
 	}
 
 	if (nFlags & FF_LOG_ELEM)
-	{
-		int i;
-		for (i=FLD_LOG_DATE; i<=FLD_LOG_LON; i++)
-			pParser->m_sFields[i].erase();
-	}
+		pParser->StartCacheLog();
 
 	if (nFlags & FF_LOG_ENC)
+	{
 		GetAttribute(attr, "encoded",
 			pParser->m_sFields[FLD_LOG_ENC]);
+		pParser->DeferField(FLD_LOG_ENC);
+	}
 
 	if (nFlags & FF_LOC_WARNING)
 		pParser->m_bLocWarning = 1;
@@ -435,88 +480,130 @@ static const stCharMap aCharMap[] = {
 	{ 0, 0 }
 };
 
+// Code points up to this limit cover every entry in aCharMap
+#define CHARMAP_LIMIT	0x2200
+
+// aCharMap entry (plus one) for each code point below CHARMAP_LIMIT
+class CCharMapIndex
+{
+public:
+	CCharMapIndex()
+	{
+		memset(m_aIndex, 0, sizeof(m_aIndex));
+
+		int i;
+		for (i=0; aCharMap[i].ch != 0; i++)
+			m_aIndex[aCharMap[i].ch] = i + 1;
+	}
+
+	const char* Lookup(unsigned long lch) const
+	{
+		if (lch >= CHARMAP_LIMIT || !m_aIndex[lch])
+			return NULL;
+
+		return aCharMap[m_aIndex[lch] - 1].str;
+	}
+
+private:
+	unsigned char m_aIndex[CHARMAP_LIMIT];
+};
+
+static const CCharMapIndex s_CharMapIndex;
+
+// Continuation bytes following each UTF-8 lead byte (-1 = stray
+// continuation byte, which is dropped), and the value subtracted from
+// the lead byte for each sequence length
+static const signed char s_aUTF8Follow[256] = {
+	 0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,
+	 0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,
+	 0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,
+	 0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,
+	 0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,
+	 0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,
+	 0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,
+	 0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,
+	-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+	-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+	-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+	-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+	 1,  1,  1,  1,  1,  1,  1,  1,  1,  1,  1,  1,  1,  1,  1,  1,
+	 1,  1,  1,  1,  1,  1,  1,  1,  1,  1,  1,  1,  1,  1,  1,  1,
+	 2,  2,  2,  2,  2,  2,  2,  2,  2,  2,  2,  2,  2,  2,  2,  2,
+	 3,  3,  3,  3,  3,  3,  3,  3,  4,  4,  4,  4,  5,  5,  5,  5
+};
+static const unsigned char s_aUTF8Base[6] = { 0, 192, 224, 240, 248, 252 };
+
+#define HIGH_BITS	0x8080808080808080ULL
+
+// Converts to the 8-bit CacheMate character set in place (the output is
+// never longer than the input).  Malformed sequences decode exactly as
+// they always have.
 void CXMLParser::DecodeUTF8(string &sStr)
 {
-	int i, n = sStr.size();
-	string sTmp;
-	unsigned long lch;
+	int n = sStr.size();
+	if (n == 0)
+		return;
+
+	char *p = &sStr[0];
+	int i = 0, w = 0;
+	unsigned long lch = 0;
 	int nch = 0;
 
-	sTmp.empty();
-	for (i=0; i<n; i++)
+	while (i < n)
 	{
-		char ch = sStr[i];
-		unsigned char uch = *(unsigned char*)(&ch);
+		if (nch == 0)
+		{	// Copy runs of plain ASCII in one go
+			int j = i;
+			uint64_t word;
 
-		if (nch > 0)
-		{
-			lch = (lch * 64) + (uch - 128);
-			nch--;
-
-			if (nch > 0)
-				continue;
-		}
-		else if (uch >= 128)
-		{
-			if (uch >= 252)
-			{
-				lch = uch - 252;
-				nch = 5;
-			}
-			else if (uch >= 248)
-			{
-				lch = uch - 248;
-				nch = 4;
-			}
-			else if (uch >= 240)
-			{
-				lch = uch - 240;
-				nch = 3;
-			}
-			else if (uch >= 224)
+			while (j + 8 <= n)
 			{
-				lch = uch - 224;
-				nch = 2;
+				memcpy(&word, p + j, 8);
+				if (word & HIGH_BITS)
+					break;
+				j += 8;
 			}
-			else if (uch >= 192)
+			while (j < n && !(p[j] & 0x80))
+				j++;
+
+			if (j > i)
 			{
-				lch = uch - 192;
-				nch = 1;
+				if (w != i)
+					memmove(p + w, p + i, j - i);
+				w += j - i;
+				i = j;
+				continue;
 			}
 
+			unsigned char uch = (unsigned char)p[i++];
+			nch = s_aUTF8Follow[uch];
+			if (nch < 0)
+				nch = 0;
+			else
+				lch = uch - s_aUTF8Base[nch];
 			continue;
 		}
-		else
-			lch = uch;
+
+		unsigned char uch = (unsigned char)p[i++];
+		lch = (lch * 64) + (uch - 128);
+		if (--nch > 0)
+			continue;
 
 		if (lch < 256)
-		{	// ASCII character code
-			uch = (unsigned char)(lch & 0xff);
-			sTmp += *(char*)(&uch);
-		}
+			p[w++] = (char)lch;
 		else
 		{	// Remap Unicode characters to ASCII
-			int i;
-			int bFound;
-			const stCharMap *pEntry;
-
-			bFound = 0;
-			for (i=0; aCharMap[i].ch != 0; i++)
+			const char *szMap = s_CharMapIndex.Lookup(lch);
+			if (szMap)
 			{
-				pEntry = &aCharMap[i];
-				if (lch == pEntry->ch)
-				{
-					bFound = 1;
-					break;
-				}
+				int nMap = strlen(szMap);
+				memcpy(p + w, szMap, nMap);
+				w += nMap;
 			}
-
-			if (bFound)
-				sTmp += pEntry->str;
 		}
 	}
 
-	sStr = sTmp;
+	sStr.resize(w);
 }
 
 void CXMLParser::TranslateTerraSizes(string &rSize)
@@ -536,29 +623,47 @@ void CXMLParser::HandleElemEnd(void *data, const char *el)
 {
 	CXMLParser *pParser = (CXMLParser*)data;
 
+	if (pParser->m_nSkipDepth == pParser->m_nDepth)
+	{
+		long nEnd = (long)XML_GetCurrentByteIndex(pParser->m_pExpat) +
+			XML_GetCurrentByteCount(pParser->m_pExpat);
+		pParser->m_nLogsSkipped++;
+		pParser->m_nLogBytesSkipped += nEnd - pParser->m_nSkipStart;
+		pParser->m_nSkipDepth = 0;
+	}
+
 	int bData, nField;
 	int32_t nFlags;
-	bData = pParser->GetElementInfo(pParser->m_sCurPath, nField, nFlags);
-	pParser->DecodeUTF8(pParser->m_sCurData);
+	bData = pParser->GetElementInfo(pParser->m_nCurNode, nField, nFlags);
 
 	if (bData)
 	{
-		if (nFlags & FF_FORCE_HTML)
+		if (pParser->m_bSkipWaypoint && IsDeferredField(nField))
+			;
+		else if (pParser->m_pDeferred && IsDeferredField(nField))
+			pParser->DeferElemData(nField, nFlags);
+		else
 		{
-			pParser->HTMLToText(pParser->m_sCurData);
-			// TerraCaching.com likes to do weird things with
-			// <br> tags
-			pParser->StripTags(pParser->m_sCurData);
-		}
+			pParser->DecodeUTF8(pParser->m_sCurData);
+
+			if (nFlags & FF_FORCE_HTML)
+			{
+				// TerraCaching.com likes to do weird things
+				// with <br> tags, so strip any left in the
+				// same pass
+				pParser->HTMLToText(pParser->m_sCurData, 1);
+			}
 
-		if ((nFlags & FF_CHECK_HTML) && pParser->m_bHtmlFlag)
-			pParser->HTMLToText(pParser->m_sCurData);
+			if ((nFlags & FF_CHECK_HTML) && pParser->m_bHtmlFlag)
+				pParser->HTMLToText(pParser->m_sCurData, 0);
 
-		if (nFlags & FF_TERRA_SIZES)
-			TranslateTerraSizes(pParser->m_sCurData);
+			if (nFlags & FF_TERRA_SIZES)
+				TranslateTerraSizes(pParser->m_sCurData);
 
-		if (nField != -1)
-			pParser->m_sFields[nField] = pParser->m_sCurData;
+			if (nField != -1)
+				pParser->m_sFields[nField] =
+					pParser->m_sCurData;
+		}
 
 		if (nFlags & FF_CACHE_ATTR)
 		{
@@ -592,22 +697,31 @@ void CXMLParser::HandleElemEnd(void *data, const char *el)
 		}
 
 		if (nFlags & FF_TIMESTAMP)
+		{
 			pParser->m_sFileTS = pParser->m_sCurData;
+			pParser->m_bFileTSSet = 1;
+		}
 	}
 
 	pParser->m_sCurData.erase();
 
-	int nPos = pParser->m_sCurPath.rfind('/');
-	pParser->m_sCurPath = pParser->m_sCurPath.substr(0, nPos);
+	pParser->m_nDepth--;
+	if (pParser->m_nDepth < MAX_PATH_DEPTH)
+		pParser->m_nCurNode = pParser->m_aNodeStack[pParser->m_nDepth];
+	else
+		pParser->m_nCurNode = PATH_NONE;
+
+	// Any text that follows belongs to the parent again
+	pParser->m_bCapture = pParser->WantsCharData(pParser->m_nCurNode);
 }
 
 void CXMLParser::HandleCharData(void *data, const char *s, int len)
 {
 	CXMLParser *pParser = (CXMLParser*)data;
-	int i;
 
-	for (i=0; i<len; i++)
-		pParser->m_sCurData += s[i];
+	// Text of elements that map to nothing is never looked at
+	if (pParser->m_bCapture)
+		pParser->m_sCurData.append(s, len);
 }
 
 void CXMLParser::StoreCacheStatus(string sAvail, string sArchived)
@@ -651,11 +765,41 @@ void CXMLParser::ReformatDate(string &sDate)
 #endif
 }
 
+void CXMLParser::StartCacheLog()
+{
+	if (m_bSkipWaypoint)
+		return;
+	if (m_pDeferred)
+	{
+		m_pDeferred->AddStep(DEFER_LOG_START);
+		m_nLogBytes = 0;
+		return;
+	}
+
+	int i;
+	for (i=FLD_LOG_DATE; i<=FLD_LOG_LON; i++)
+		m_sFields[i].erase();
+}
+
 void CXMLParser::CompileCacheLog()
 {
 	string sLog, sCoords;
 	double dLat, dLon;
 
+	if (m_bSkipWaypoint)
+		return;
+	if (m_pDeferred)
+	{
+		m_pDeferred->AddStep(DEFER_LOG_END);
+
+		int nBound = m_nLogBytes + LOG_HEADER_MAX;
+		if (nBound > MAX_LOG_SIZE)
+			nBound = MAX_LOG_SIZE;
+		m_nLogsBound += nBound + 1;
+		m_nLogsSeen++;
+		return;
+	}
+
 	sCoords.erase();
 	ConvertCoords(m_sFields[FLD_LOG_LAT], m_sFields[FLD_LOG_LON],
 		sCoords, dLat, dLon);
@@ -686,7 +830,7 @@ void CXMLParser::CompileCacheLog()
 	sLog += m_sFields[FLD_LOG_TEXT];
 
 	// Check size and number of logs against limits
-	if (sLog.size() > 3072)
+	if (sLog.size() > MAX_LOG_SIZE)
 	{
 		sLog = sLog.substr(0, 3060);
 		sLog += "\n[truncated]";
@@ -714,12 +858,255 @@ void CXMLParser::ClearWaypoint()
 		m_sFields[i].erase();
 
 	m_nCurLogs = 0;
+	m_nLogsSeen = 0;
+	m_nLogsBound = 0;
+	m_nLogBytes = 0;
 	m_bHasBugs = 0;
 	m_bCacheActive = 1;
+
+	// Conversion can wait as long as the text of this waypoint can't
+	// change how the rest of the file is read
+	delete m_pDeferred;
+	m_pDeferred = NULL;
+	m_bSkipWaypoint = 0;
+	m_bFilterChecked = 0;
+	if (m_bDeferRecords && !m_bEmptyDesc && !m_bNonCacheFile &&
+			!m_bLongDesc)
+		m_pDeferred = new CDeferredRecord(*this);
+}
+
+// Whether a cache log starting now can't make it into the record
+int CXMLParser::CanSkipCacheLog()
+{
+	if (!m_pDeferred)
+		return (m_nCurLogs >= m_nMaxLogs);
+
+	// The logs of a deferred record are only compiled later, so the
+	// count of logs seen so far is only certain if none of them can
+	// have been dropped for size
+	return (m_nLogsSeen >= m_nMaxLogs && m_nLogsBound <= MAX_LOGS_SIZE);
+}
+
+// Skip the rest of a waypoint that fails the filters
+void CXMLParser::CheckFilter()
+{
+	m_bFilterChecked = 1;
+
+	string &rLat = m_sFields[FLD_LAT];
+	string &rLon = m_sFields[FLD_LON];
+	if (rLat.empty() || rLon.empty())
+		return;
+
+	// Fields as FinishWaypointRecord will store them
+	CWPData wp;
+	wp.m_sWaypoint = m_sFields[FLD_WAYPOINT];
+	wp.m_sSymbol = m_sFields[FLD_SYMBOL];
+	wp.m_sType = m_sFields[m_sFields[FLD_TYPE2].empty() ?
+		FLD_TYPE : FLD_TYPE2];
+	wp.m_sContainer = m_sFields[FLD_CONTAINER];
+	wp.m_sState = m_sFields[FLD_STATE];
+	wp.m_sCountry = m_sFields[FLD_COUNTRY];
+	wp.m_sOwner = m_sFields[FLD_OWNER];
+	wp.m_bActive = m_bCacheActive;
+	wp.m_dLat = atof(rLat.c_str());
+	wp.m_dLon = atof(rLon.c_str());
+
+	// Something that isn't a cache may still change how the rest of
+	// the file is read
+	if (!CUtil::ContainsNoCase(wp.m_sSymbol, "geocache") &&
+			!CUtil::ContainsNoCase(wp.m_sType, "geocache"))
+		return;
+
+	if (wp.m_sType.compare(0, 9, "Waypoint|") == 0)
+		wp.m_sType.erase(0, 9);
+
+	if (m_pFilter->Matches(&wp, 0))
+		return;
+
+	delete m_pDeferred;
+	m_pDeferred = NULL;
+	m_bSkipWaypoint = 1;
+}
+
+// Fields only read when the record text is put together
+int CXMLParser::IsDeferredField(int nField)
+{
+	return (nField == FLD_HINTS || nField == FLD_SHRT_DESC ||
+		nField == FLD_LONG_DESC ||
+		(nField >= FLD_LOG_DATE && nField <= FLD_LOG_LON));
+}
+
+// Move a field set from attributes into the deferred steps
+void CXMLParser::DeferField(int nField)
+{
+	if (m_pDeferred)
+		m_pDeferred->AddStep(DEFER_SET, nField, 0, m_sFields[nField]);
+}
+
+void CXMLParser::DeferElemData(int nField, int32_t nFlags)
+{
+	int nConvert = DEFER_UTF8;
+
+	if (nFlags & FF_FORCE_HTML)
+		nConvert |= DEFER_HTML_STRIP;
+	if ((nFlags & FF_CHECK_HTML) && m_bHtmlFlag)
+		nConvert |= DEFER_HTML;
+
+	// Size of the log the data will be compiled into
+	if (nField >= FLD_LOG_DATE && nField <= FLD_LOG_LON)
+	{
+		if (nConvert & (DEFER_HTML | DEFER_HTML_STRIP))
+			m_nLogBytes = MAX_LOG_SIZE;
+		else
+			m_nLogBytes += m_sCurData.size();
+	}
+
+	m_pDeferred->AddStep(DEFER_SET, nField, nConvert, m_sCurData);
+}
+
+void CXMLParser::ReplaySteps(CDeferredRecord *pRec)
+{
+	CDeferredRecord::StepList::iterator iter = pRec->m_Steps.begin();
+	while (iter != pRec->m_Steps.end())
+	{
+		switch (iter->nType)
+		{
+		case DEFER_SET:
+		{
+			string &rField = m_sFields[iter->nField];
+			rField.swap(iter->sData);
+
+			if (iter->nConvert & DEFER_UTF8)
+				DecodeUTF8(rField);
+			if (iter->nConvert & DEFER_HTML_STRIP)
+				HTMLToText(rField, 1);
+			if (iter->nConvert & DEFER_HTML)
+				HTMLToText(rField, 0);
+			break;
+		}
+
+		case DEFER_LINK:
+			AddLinkToRecord(iter->sData);
+			break;
+
+		case DEFER_LOG_START:
+			StartCacheLog();
+			break;
+
+		case DEFER_LOG_END:
+			CompileCacheLog();
+			break;
+		}
+
+		iter++;
+	}
+}
+
+void CXMLParser::FinishDeferred(CDeferredRecord *pRec, CWPData *pWP)
+{
+	int bDescTrunc;
+
+	// The fields kept in the waypoint are lent back while the record
+	// is built
+	SwapListedFields(pWP);
+	ReplaySteps(pRec);
+	BuildDescription(bDescTrunc);
+	StoreRecord(pWP, bDescTrunc);
+	SwapListedFields(pWP);
+}
+
+CDeferredRecord::CDeferredRecord(const CXMLParser &rParser)
+{
+	m_bLocation = rParser.m_bLocation;
+	m_bContainer = rParser.m_bContainer;
+	m_bOwner = rParser.m_bOwner;
+	m_bDate = rParser.m_bDate;
+	m_bShowBugs = rParser.m_bShowBugs;
+	m_bDecodeHints = rParser.m_bDecodeHints;
+	m_nMaxLogs = rParser.m_nMaxLogs;
+	m_nMaxDesc = rParser.m_nMaxDesc;
+	m_bCacheStatus = rParser.m_bCacheStatus;
+}
+
+void CDeferredRecord::AddStep(int nType)
+{
+	string sNone;
+	AddStep(nType, -1, 0, sNone);
+}
+
+// Takes the data (leaving rData empty)
+void CDeferredRecord::AddStep(int nType, int nField, int nConvert,
+	string &rData)
+{
+	m_Steps.resize(m_Steps.size() + 1);
+
+	stStep &rStep = m_Steps.back();
+	rStep.nType = nType;
+	rStep.nField = nField;
+	rStep.nConvert = nConvert;
+	rStep.sData.swap(rData);
+}
+
+void CDeferredRecord::Finish(CWPData *pWP)
+{
+	CXMLParser parser;
+
+	parser.m_bLocation = m_bLocation;
+	parser.m_bContainer = m_bContainer;
+	parser.m_bOwner = m_bOwner;
+	parser.m_bDate = m_bDate;
+	parser.m_bShowBugs = m_bShowBugs;
+	parser.m_bDecodeHints = m_bDecodeHints;
+	parser.m_nMaxLogs = m_nMaxLogs;
+	parser.m_nMaxDesc = m_nMaxDesc;
+	parser.m_bCacheStatus = m_bCacheStatus;
+	parser.FinishDeferred(this, pWP);
+}
+
+int CDeferredRecord::SameInput(IDeferredRecord *pOther)
+{
+	CDeferredRecord *pRec = (CDeferredRecord*)pOther;
+
+	if (m_bLocation != pRec->m_bLocation ||
+			m_bContainer != pRec->m_bContainer ||
+			m_bOwner != pRec->m_bOwner ||
+			m_bDate != pRec->m_bDate ||
+			m_bShowBugs != pRec->m_bShowBugs ||
+			m_bDecodeHints != pRec->m_bDecodeHints ||
+			m_nMaxLogs != pRec->m_nMaxLogs ||
+			m_nMaxDesc != pRec->m_nMaxDesc ||
+			m_bCacheStatus != pRec->m_bCacheStatus)
+		return 0;
+
+	if (m_Steps.size() != pRec->m_Steps.size())
+		return 0;
+
+	int i, n = m_Steps.size();
+	for (i=0; i<n; i++)
+	{
+		stStep &rStep1 = m_Steps[i];
+		stStep &rStep2 = pRec->m_Steps[i];
+
+		if (rStep1.nType != rStep2.nType ||
+				rStep1.nField != rStep2.nField ||
+				rStep1.nConvert != rStep2.nConvert ||
+				rStep1.sData != rStep2.sData)
+			return 0;
+	}
+
+	return 1;
 }
 
 void CXMLParser::AddLinkToRecord(string sURL)
 {
+	if (m_bSkipWaypoint)
+		return;
+	if (m_pDeferred)
+	{	// Links are collected in document order
+		m_pDeferred->AddStep(DEFER_LINK, -1, 0, sURL);
+		return;
+	}
+
 	string &rWptURL = m_sFields[FLD_URL];
 	if (rWptURL.empty() && (
 		sURL.substr(0,49) ==
@@ -782,305 +1169,549 @@ typedef struct stEntMap
 	const char *name;
 	uint32_t ch;
 } stEntMap;
+// HTML5 named entities (lowercased, as they are looked up) whose values
+// exist in the CacheMate character set, either directly or through
+// aCharMap.  Sorted by name for binary search.
 static const stEntMap aEntMap[] = {
-	{ "nbsp", ' ' },
-	{ "gt", '>' },
-	{ "lt", '<' },
+	{ "aacute", 225 },
+	{ "acirc", 226 },
+	{ "acute", 180 },
+	{ "aelig", 230 },
+	{ "agrave", 224 },
 	{ "amp", '&' },
-	{ "quot", '\"' },
-	{ "iexcl", 161 },
-	{ "cent", 162 },
-	{ "pound", 163 },
-	{ "curren", 164 },
-	{ "yen", 165 },
+	{ "angst", 197 },
+	{ "apos", '\'' },
+	{ "aring", 229 },
+	{ "ast", '*' },
+	{ "atilde", 227 },
+	{ "auml", 228 },
+	{ "bdquo", 8222 },
 	{ "brvbar", 166 },
-	{ "sect", 167 },
-	{ "uml", 168 },
+	{ "bsol", '\\' },
+	{ "bull", 8226 },
+	{ "bullet", 8226 },
+	{ "ccedil", 231 },
+	{ "cedil", 184 },
+	{ "cedilla", 184 },
+	{ "cent", 162 },
+	{ "centerdot", 183 },
+	{ "circ", 710 },
+	{ "circledr", 174 },
+	{ "closecurlydoublequote", 8221 },
+	{ "closecurlyquote", 8217 },
+	{ "colon", ':' },
+	{ "comma", ',' },
+	{ "commat", '@' },
 	{ "copy", 169 },
-	{ "ordf", 170 },
-	{ "laquo", 171 },
-	{ "not", 172 },
-	{ "shy", 173 },
-	{ "reg", 174 },
-	{ "macr", 175 },
+	{ "curren", 164 },
+	{ "dagger", 8224 },
+	{ "ddagger", 8225 },
 	{ "deg", 176 },
-	{ "plusmn", 177 },
-	{ "sup2", 178 },
-	{ "sup3", 179 },
-	{ "acute", 180 },
-	{ "micro", 181 },
-	{ "para", 182 },
-	{ "middot", 183 },
-	{ "cedil", 184 },
-	{ "sup1", 185 },
-	{ "ordm", 186 },
-	{ "raquo", 187 },
-	{ "frac14", 188 },
-	{ "frac12", 189 },
-	{ "frac34", 190 },
-	{ "iquest", 191 },
-	{ "times", 215 },
-	{ "szlig", 223 },
-	{ "agrave", 224 },
-	{ "aacute", 225 },
-	{ "acirc", 226 },
-	{ "atilde", 227 },
-	{ "auml", 228 },
-	{ "aring", 229 },
-	{ "aelig", 230 },
-	{ "ccedil", 231 },
-	{ "egrave", 232 },
+	{ "diacriticalacute", 180 },
+	{ "diacriticalgrave", '`' },
+	{ "diacriticaltilde", 732 },
+	{ "die", 168 },
+	{ "div", 247 },
+	{ "divide", 247 },
+	{ "dollar", '$' },
+	{ "doubledot", 168 },
 	{ "eacute", 233 },
 	{ "ecirc", 234 },
+	{ "egrave", 232 },
+	{ "equals", '=' },
+	{ "eth", 240 },
 	{ "euml", 235 },
-	{ "igrave", 236 },
+	{ "euro", 8364 },
+	{ "excl", '!' },
+	{ "fnof", 402 },
+	{ "frac12", 189 },
+	{ "frac14", 188 },
+	{ "frac34", 190 },
+	{ "grave", '`' },
+	{ "gt", '>' },
+	{ "half", 189 },
+	{ "hat", '^' },
+	{ "hellip", 8230 },
 	{ "iacute", 237 },
 	{ "icirc", 238 },
+	{ "iexcl", 161 },
+	{ "igrave", 236 },
+	{ "iquest", 191 },
 	{ "iuml", 239 },
-	{ "eth", 240 },
+	{ "laquo", 171 },
+	{ "lbrace", '{' },
+	{ "lbrack", '[' },
+	{ "lcub", '{' },
+	{ "ldquo", 8220 },
+	{ "ldquor", 8222 },
+	{ "lowbar", '_' },
+	{ "lpar", '(' },
+	{ "lsaquo", 8249 },
+	{ "lsqb", '[' },
+	{ "lsquo", 8216 },
+	{ "lsquor", 8218 },
+	{ "lt", '<' },
+	{ "macr", 175 },
+	{ "mdash", 8212 },
+	{ "micro", 181 },
+	{ "midast", '*' },
+	{ "middot", 183 },
+	{ "mldr", 8230 },
+	{ "nbsp", ' ' },
+	{ "ndash", 8211 },
+	{ "newline", 10 },
+	{ "nonbreakingspace", ' ' },
+	{ "not", 172 },
 	{ "ntilde", 241 },
-	{ "ograve", 242 },
+	{ "num", '#' },
 	{ "oacute", 243 },
 	{ "ocirc", 244 },
+	{ "oelig", 339 },
+	{ "ograve", 242 },
+	{ "opencurlydoublequote", 8220 },
+	{ "opencurlyquote", 8216 },
+	{ "ordf", 170 },
+	{ "ordm", 186 },
+	{ "oslash", 248 },
 	{ "otilde", 245 },
 	{ "ouml", 246 },
-	{ "divide", 247 },
-	{ "oslash", 248 },
-	{ "ugrave", 249 },
+	{ "para", 182 },
+	{ "percnt", '%' },
+	{ "period", '.' },
+	{ "permil", 8240 },
+	{ "plus", '+' },
+	{ "plusminus", 177 },
+	{ "plusmn", 177 },
+	{ "pm", 177 },
+	{ "pound", 163 },
+	{ "quest", '?' },
+	{ "quot", '\"' },
+	{ "raquo", 187 },
+	{ "rbrace", '}' },
+	{ "rbrack", ']' },
+	{ "rcub", '}' },
+	{ "rdquo", 8221 },
+	{ "rdquor", 8221 },
+	{ "reg", 174 },
+	{ "rpar", ')' },
+	{ "rsaquo", 8250 },
+	{ "rsqb", ']' },
+	{ "rsquo", 8217 },
+	{ "rsquor", 8217 },
+	{ "sbquo", 8218 },
+	{ "scaron", 353 },
+	{ "sect", 167 },
+	{ "semi", ';' },
+	{ "shy", 173 },
+	{ "sol", '/' },
+	{ "strns", 175 },
+	{ "sup1", 185 },
+	{ "sup2", 178 },
+	{ "sup3", 179 },
+	{ "szlig", 223 },
+	{ "tab", 9 },
+	{ "thorn", 254 },
+	{ "tilde", 732 },
+	{ "times", 215 },
+	{ "trade", 8482 },
 	{ "uacute", 250 },
 	{ "ucirc", 251 },
+	{ "ugrave", 249 },
+	{ "uml", 168 },
+	{ "underbar", '_' },
 	{ "uuml", 252 },
+	{ "verbar", '|' },
+	{ "vert", '|' },
+	{ "verticalline", '|' },
 	{ "yacute", 253 },
-	{ "thorn", 254 },
+	{ "yen", 165 },
 	{ "yuml", 255 },
-	{ "oelig", 339 },
-	{ "scaron", 353 },
-	{ "fnof", 402 },
-	{ "circ", 710 },
-	{ "tilde", 732 },
-	{ "ndash", 8211 },
-	{ "mdash", 8212 },
-	{ "lsquo", 8216 },
-	{ "rsquo", 8217 },
-	{ "sbquo", 8218 },
-	{ "ldquo", 8220 },
-	{ "rdquo", 8221 },
-	{ "bdquo", 8222 },
-	{ "dagger", 8224 },
-	{ "bull", 8226 },
-	{ "hellip", 8230 },
-	{ "permil", 8240 },
-	{ "lsaquo", 8249 },
-	{ "rsaquo", 8250 },
-	{ "trade", 8482 },
-	{ NULL, 0 }
 };
+#define ENTMAP_SIZE	(sizeof(aEntMap) / sizeof(aEntMap[0]))
 
-void CXMLParser::DecodeEntity(string &sEnt, string &sValue)
+int CXMLParser::DecodeEntity(const char *szEnt, char *pValue)
 {
-	sValue.erase();
-	int nValue = 0;
+	uint32_t nValue = 0;
 
-	const char *pStr = sEnt.c_str();
-	if (*pStr == '#')
+	if (*szEnt == '#')
 	{
-		if (pStr[1] == 'x')
-			nValue = strtoul(pStr+2, NULL, 16);
+		int nNum;
+		if (szEnt[1] == 'x')
+			nNum = strtoul(szEnt+2, NULL, 16);
 		else
-			nValue = strtoul(pStr+1, NULL, 10);
+			nNum = strtoul(szEnt+1, NULL, 10);
+
+		if (nNum > 0)
+			nValue = nNum;
 	}
 	else
 	{
-		stEntMap *pEnt = (stEntMap*)aEntMap;
-		while (pEnt->name)
+		int nLow = 0, nHigh = ENTMAP_SIZE - 1;
+		while (nLow <= nHigh)
 		{
-			if (pEnt->name == sEnt)
+			int nMid = (nLow + nHigh) / 2;
+			int nCmp = strcmp(szEnt, aEntMap[nMid].name);
+
+			if (nCmp == 0)
 			{
-				nValue = pEnt->ch;
+				nValue = aEntMap[nMid].ch;
 				break;
 			}
 
-			pEnt++;
+			if (nCmp < 0)
+				nHigh = nMid - 1;
+			else
+				nLow = nMid + 1;
 		}
 	}
 
-	if (nValue > 0)
+	if (nValue == 0)
+		return 0;
+
+	if (nValue < 256)
+	{
+		pValue[0] = (char)nValue;
+		return 1;
+	}
+
+	const char *szMap = s_CharMapIndex.Lookup(nValue);
+	if (!szMap)
+		return 0;
+
+	int nLen = strlen(szMap);
+	memcpy(pValue, szMap, nLen);
+	return nLen;
+}
+
+// Tags that HTMLToText acts on
+#define HT_OTHER	0
+#define HT_P		1
+#define HT_END_P	2
+#define HT_BR		3
+#define HT_LI		4
+#define HT_END_LI	5
+#define HT_LIST		6
+#define HT_END_LIST	7
+#define HT_TABLE	8
+#define HT_END_TABLE	9
+#define HT_END_ROW	10
+#define HT_END_CELL	11
+#define HT_PRE		12
+#define HT_END_PRE	13
+#define HT_LINK		14
+#define HT_IMAGE	15
+
+// Longer tag names than this are none of the above
+#define HT_NAME_MAX	16
+// Entity names are lowercased into a buffer of this size when they fit
+#define HT_ENTITY_MAX	64
+
+static int GetTagCode(const char *szTag, int nLen)
+{
+	switch (nLen)
+	{
+	case 1:
+		if (*szTag == 'p') return HT_P;
+		if (*szTag == 'a') return HT_LINK;
+		break;
+	case 2:
+		if (!memcmp(szTag, "/p", 2)) return HT_END_P;
+		if (!memcmp(szTag, "br", 2)) return HT_BR;
+		if (!memcmp(szTag, "li", 2)) return HT_LI;
+		if (!memcmp(szTag, "ul", 2)) return HT_LIST;
+		if (!memcmp(szTag, "ol", 2)) return HT_LIST;
+		break;
+	case 3:
+		if (!memcmp(szTag, "/li", 3)) return HT_END_LI;
+		if (!memcmp(szTag, "/ul", 3)) return HT_END_LIST;
+		if (!memcmp(szTag, "/ol", 3)) return HT_END_LIST;
+		if (!memcmp(szTag, "/tr", 3)) return HT_END_ROW;
+		if (!memcmp(szTag, "/th", 3)) return HT_END_CELL;
+		if (!memcmp(szTag, "/td", 3)) return HT_END_CELL;
+		if (!memcmp(szTag, "pre", 3)) return HT_PRE;
+		if (!memcmp(szTag, "img", 3)) return HT_IMAGE;
+		break;
+	case 4:
+		if (!memcmp(szTag, "/pre", 4)) return HT_END_PRE;
+		break;
+	case 5:
+		if (!memcmp(szTag, "table", 5)) return HT_TABLE;
+		if (!memcmp(szTag, "image", 5)) return HT_IMAGE;
+		break;
+	case 6:
+		if (!memcmp(szTag, "/table", 6)) return HT_END_TABLE;
+		break;
+	case 8:
+		if (!memcmp(szTag, "/caption", 8)) return HT_END_ROW;
+		break;
+	}
+
+	return HT_OTHER;
+}
+
+static void LowercaseCopy(char *pOut, const char *pIn, int nLen)
+{
+	while (nLen--)
+	{
+		char ch = *pIn++;
+		if (ch >= 'A' && ch <= 'Z')
+			ch = ch - 'A' + 'a';
+		*pOut++ = ch;
+	}
+}
+
+// Output of HTMLToText.  Counts trailing newlines of the text written
+// so far, and can drop anything in it that still looks like a tag, the
+// way StripTags does.
+class CHTMLText
+{
+public:
+	CHTMLText(string &rOut, int bStripTags) : m_rOut(rOut)
+	{
+		m_bStrip = bStripTags;
+		m_nLen = 0;
+		m_nTrailNL = 0;
+		m_bTag = 0;
+		m_bLT = 0;
+	}
+
+	void Put(char ch)
+	{
+		m_nLen++;
+		m_nTrailNL = (ch == '\n') ? (m_nTrailNL + 1) : 0;
+
+		if (m_bStrip)
+			Strip(ch);
+		else
+			m_rOut += ch;
+	}
+
+	void Put(const char *pStr, int nLen)
 	{
-		if (nValue >= 256)
+		if (nLen <= 0)
+			return;
+
+		int j = nLen;
+		while (j > 0 && pStr[j-1] == '\n')
+			j--;
+
+		m_nLen += nLen;
+		m_nTrailNL = (j == 0) ? (m_nTrailNL + nLen) : (nLen - j);
+
+		if (!m_bStrip)
 		{
-			stCharMap *pChar = (stCharMap*)aCharMap;
-			while (pChar->ch)
-			{
-				if (pChar->ch == nValue)
-				{
-					sValue = pChar->str;
+			m_rOut.append(pStr, nLen);
+			return;
+		}
+
+		while (nLen > 0)
+		{
+			if (!m_bTag && !m_bLT)
+			{	// Nothing to strip up to the next '<'
+				const char *pLT = (const char*)memchr(pStr, '<',
+					nLen);
+				int nRun = pLT ? (pLT - pStr) : nLen;
+
+				m_rOut.append(pStr, nRun);
+				pStr += nRun;
+				nLen -= nRun;
+				if (nLen == 0)
 					break;
-				}
+			}
 
-				pChar++;
+			Strip(*pStr++);
+			nLen--;
+		}
+	}
+
+	// Already two newlines, or nothing yet
+	int TooMuch() const { return (m_nLen == 0 || m_nTrailNL >= 2); }
+	int AtNewline() const { return (m_nTrailNL > 0); }
+
+private:
+	string &m_rOut;
+	int m_bStrip;
+	int m_nLen;
+	int m_nTrailNL;
+	int m_bTag;
+	int m_bLT;
+
+	void Strip(char ch)
+	{
+		if (m_bTag)
+		{
+			if (ch == '>')
+				m_bTag = 0;
+			return;
+		}
+
+		if (m_bLT)
+		{
+			m_bLT = 0;
+
+			if (ch == '/' || (ch >= 'a' && ch <= 'z') ||
+					(ch >= 'A' && ch <= 'Z'))
+			{
+				m_bTag = 1;
+				return;
 			}
+
+			m_rOut += '<';
 		}
-		else
-			sValue = (char)nValue;
+		else if (ch == '<')
+		{
+			m_bLT = 1;
+			return;
+		}
+
+		m_rOut += ch;
 	}
-}
+};
 
-void CXMLParser::HTMLToText(string &sStr)
+void CXMLParser::HTMLToText(string &sStr, int bStripTags)
 {
 	string sResult;
-	int i, n;
-	string sTag, sEntity, sArgs;
+	sResult.reserve(sStr.size());
+	CHTMLText out(sResult, bStripTags);
+
+	const char *p = sStr.data();
+	int i, n = sStr.size();
+	int nTag = 0, nTagEnd = 0, nEntity = 0;
 	int bTag = 0, bWS = 1, bTagName = 0, bEntity = 0, bPre = 0;
 	int bListItem = 0;
 
-	n = sStr.size();
 	for (i=0; i<n; i++)
 	{
-		char ch = sStr[i];
-		int bWSChar = (strchr(" \t\r\n", ch) != NULL);
+		char ch = p[i];
+		int bWSChar = (ch == ' ' || ch == '\t' || ch == '\r' ||
+			ch == '\n' || ch == 0);
 
 		if (bTag)
 		{
-			if (bTagName)
+			if (bTagName && (bWSChar || (ch == '>')))
 			{
-				if (bWSChar || (ch == '>'))
-					bTagName = 0;
-				else 
-					sTag += ch;
+				bTagName = 0;
+				nTagEnd = i;
 			}
 
-			if (ch == '>')
+			if (ch != '>')
+				continue;
+
+			bTag = 0;
+
+			int nCode = HT_OTHER;
+			int nLen = nTagEnd - nTag;
+			if (nLen < HT_NAME_MAX)
 			{
-				bTag = 0;
-				CUtil::LowercaseString(sTag);
+				char szTag[HT_NAME_MAX];
+				LowercaseCopy(szTag, p + nTag, nLen);
+				nCode = GetTagCode(szTag, nLen);
+			}
 
-				int bTooMuch = 0;
-				int nLen = sResult.size();
-				if (nLen >= 2)
-				{
-					if (sResult.substr(nLen-2, 2) == "\n\n")
-						bTooMuch = 1;
-				}
-				else if (nLen == 0)
-					bTooMuch = 1;
+			int bTooMuch = out.TooMuch();
+			int bNL = out.AtNewline();
 
-				int bNL = 0;
-				if (nLen >= 1 &&
-					sResult.substr(nLen-1) == "\n")
-					bNL = 1;
+			int bHandled = 1;
+			switch (nCode)
+			{
+			case HT_P:
+			case HT_TABLE:
+				if (!bTooMuch)
+					out.Put("\n\n", 2);
+				break;
+			case HT_END_P:
+			case HT_BR:
+			case HT_LIST:
+			case HT_END_TABLE:
+				if (!bTooMuch)
+					out.Put('\n');
+				break;
+			case HT_LI:
+				if (!bTooMuch && bListItem)
+					out.Put('\n');
 
-				int bHandled = 1;
-				if (sTag == "p")
-				{
-					if (!bTooMuch)
-						sResult += "\n\n";
-				}
-				else if (sTag == "/p")
-				{
-					if (!bTooMuch)
-						sResult += "\n";
-				}
-				else if (sTag == "br")
-				{
-					if (!bTooMuch)
-						sResult += "\n";
-				}
-				else if (sTag == "li")
-				{
-					if (!bTooMuch && bListItem)
-						sResult += "\n";
+				out.Put("* ", 2);
+				bListItem = 1;
+				break;
+			case HT_END_LI:
+			case HT_END_LIST:
+				bListItem = 0;
+				if (!bTooMuch)
+					out.Put('\n');
+				break;
+			case HT_END_ROW:
+				if (!bNL)
+					out.Put('\n');
+				break;
+			case HT_END_CELL:
+				if (!bWS)
+					out.Put(' ');
+				break;
+			default:
+				bHandled = 0;
+			}
 
-					sResult += "* ";
-					bListItem = 1;
-				}
-				else if (sTag == "/li")
-				{
-					bListItem = 0;
-					if (!bTooMuch)
-						sResult += "\n";
-				}
-				else if (sTag == "ul" || sTag == "ol")
-				{
-					if (!bTooMuch)
-						sResult += "\n";
-				}
-				else if (sTag == "/ul" || sTag == "/ol")
-				{
-					bListItem = 0;
-					if (!bTooMuch)
-						sResult += "\n";
-				}
-				else if (sTag == "table")
-				{
-					if (!bTooMuch)
-						sResult += "\n\n";
-				}
-				else if (sTag == "/table")
-				{
-					if (!bTooMuch)
-						sResult += "\n";
-				}
-				else if (sTag == "/tr" || sTag == "/caption")
-				{
-					if (!bNL)
-						sResult += "\n";
-				}
-				else if (sTag == "/th" || sTag == "/td")
-				{
-					if (!bWS)
-						sResult += " ";
-				}
-				else
-					bHandled = 0;
+			if (bHandled)
+				bWS = 1;
 
-				if (bHandled)
-					bWS = 1;
+			if (nCode == HT_PRE)
+				bPre = 1;
+			else if (nCode == HT_END_PRE)
+				bPre = 0;
 
-				if (sTag == "pre")
-					bPre = 1;
-				else if (sTag == "/pre")
-					bPre = 0;
+			if (nCode == HT_LINK || nCode == HT_IMAGE)
+			{	// Attributes, with whitespace as plain spaces
+				string sArgs(p + nTagEnd, i - nTagEnd);
+				int j;
+				for (j=0; j<(int)sArgs.size(); j++)
+				{
+					if (strchr(" \t\r\n", sArgs[j]))
+						sArgs[j] = ' ';
+				}
 
-				ExtractURL(sTag, sArgs);
-			}
-			else if (!bTagName)
-			{
-				if (bWSChar)
-					sArgs += ' ';
-				else
-					sArgs += ch;
+				ExtractURL((nCode == HT_LINK) ? "a" : "img", sArgs);
 			}
 		}
 		else if (bEntity)
 		{
 			if (bWSChar)
-			{
+			{	// Not an entity after all
 				bEntity = 0;
-				sResult += "&";
-				sResult += sEntity + ch;
+				out.Put(p + nEntity, i + 1 - nEntity);
 			}
 			else if (ch == ';')
 			{
-				string sValue;
+				char szValue[ENTITY_VALUE_MAX];
+				int nLen = i - (nEntity + 1);
+				int nValue;
 
 				bEntity = 0;
-				CUtil::LowercaseString(sEntity);
-				DecodeEntity(sEntity, sValue);
-				sResult += sValue;
+				if (nLen < HT_ENTITY_MAX)
+				{
+					char szEntity[HT_ENTITY_MAX];
+					LowercaseCopy(szEntity, p + nEntity + 1, nLen);
+					szEntity[nLen] = 0;
+					nValue = DecodeEntity(szEntity, szValue);
+				}
+				else
+				{
+					string sEntity(p + nEntity + 1, nLen);
+					CUtil::LowercaseString(sEntity);
+					nValue = DecodeEntity(sEntity.c_str(), szValue);
+				}
+
+				out.Put(szValue, nValue);
 			}
-			else
-				sEntity += ch;
 		}
 		else if (ch == '<')
 		{
-			sTag.erase();
-			sArgs.erase();
+			nTag = i + 1;
 			bTag = 1;
 			bTagName = 1;
 		}
 		else if (ch == '&')
 		{
-			sEntity.erase();
+			nEntity = i;
 			bEntity = 1;
 			bWS = 0;
 		}
@@ -1088,18 +1719,25 @@ void CXMLParser::HTMLToText(string &sStr)
 		{
 			if (!bWS)
 			{
-				sResult += ' ';
+				out.Put(' ');
 				bWS = 1;
 			}
 		}
 		else
-		{
+		{	// Copy plain text up to the next space, tag or entity
+			int j = i + 1;
+			while (j < n && p[j] != '<' && p[j] != '&' &&
+					p[j] != ' ' && p[j] != '\t' && p[j] != '\r' &&
+					p[j] != '\n' && p[j] != 0)
+				j++;
+
 			bWS = 0;
-			sResult += ch;
+			out.Put(p + i, j - i);
+			i = j - 1;
 		}
 	}
 
-	sStr = sResult;
+	sStr.swap(sResult);
 }
 
 void CXMLParser::EncodeHints(int nField)
@@ -1134,7 +1772,7 @@ void CXMLParser::ConvertCoords(string &sLat, string &sLon, string &sCoord,
 	double &dLat, double &dLon)
 {
 	double dLatD, dLatM, dLonD, dLonM;
-	static char buf[64];
+	char buf[64];
 	int bWestLon = 0, bSouthLat = 0;
 
 	sCoord.erase();
@@ -1179,7 +1817,7 @@ void CXMLParser::StripQuotes(string &rStr)
 		if (rStr[0] == '"')
 			bDouble = 1;
 
-		rStr = rStr.substr(1);
+		rStr.erase(0, 1);
 		nCount++;
 	}
 
@@ -1187,19 +1825,14 @@ void CXMLParser::StripQuotes(string &rStr)
 	{
 		int nPos = rStr.find('"');
 		if (nPos != string::npos)
-		{
-			string sTemp = rStr.substr(0, nPos);
-			if (nPos != (rStr.size() - 1))
-				sTemp += rStr.substr(nPos+1);
-			rStr = sTemp;
-		}
+			rStr.erase(nPos, 1);
 	}
 
 	if (nCount > 0)
 	{
 		int nLen = rStr.size();
 		while (nLen > 0 && strchr("\"'", rStr[nLen-1]) != NULL)
-			rStr = rStr.substr(0, --nLen);
+			rStr.erase(--nLen);
 	}
 }
 
@@ -1265,52 +1898,159 @@ void CXMLParser::FinishWaypointRecord()
 {
 	int i;
 
-	StripTags(m_sFields[FLD_HINTS]);
-	CUtil::StripWhitespace(m_sFields[FLD_HINTS]);
-	if (!m_bDecodeHints)
-		EncodeHints(FLD_HINTS);
-
 	double dLat, dLon;
 	ConvertCoords(m_sFields[FLD_LAT], m_sFields[FLD_LON],
 		m_sFields[FLD_COORD], dLat, dLon);
 
-	m_sFields[FLD_DESC].erase();
+	if (!m_sFields[FLD_NAME2].empty())
+		m_sFields[FLD_NAME] = m_sFields[FLD_NAME2];
+	if (!m_sFields[FLD_TYPE2].empty())
+		m_sFields[FLD_TYPE] = m_sFields[FLD_TYPE2];
 
-	string sDesc;
-	for (i=FLD_SHRT_DESC; i<= FLD_LONG_DESC; i++)
-	{
-		string &rDesc = m_sFields[i];
+	if (m_bStripNameQuotes)
+		StripQuotes(m_sFields[FLD_NAME]);
 
-		if (IsWhitespace(rDesc))
-			continue;
+	CUtil::StripWhitespace(m_sFields[FLD_NAME]);
+	if (m_sFields[FLD_NAME].empty())
+		m_sFields[FLD_NAME] = "Geocache";
 
-		CUtil::StripWhitespace(rDesc);
-		if (i == FLD_SHRT_DESC)
-			rDesc += "\n\n";
+	if (m_bLogTemplate)
+		m_sFields[FLD_NOTES] = "Took: \nLeft: \nTB: \n";
 
-		sDesc += rDesc;
+	if (!CUtil::ContainsNoCase(m_sFields[FLD_SYMBOL], "geocache") &&
+			!CUtil::ContainsNoCase(m_sFields[FLD_TYPE], "geocache"))
+		m_bNonCacheFile = 1;
+
+	// A waypoint that turned out not to be a cache is converted now,
+	// since its description decides how later ones are read
+	CDeferredRecord *pRec = m_pDeferred;
+	m_pDeferred = NULL;
+	int bSkipped = m_bSkipWaypoint;
+	int bDefer = (pRec && !m_bNonCacheFile);
+	if (pRec && !bDefer)
+	{
+		ReplaySteps(pRec);
+		delete pRec;
 	}
 
 	string &rDesc = m_sFields[FLD_DESC];
-	int bExtra = 0;
-
-	// CM2GPX-supported fields
+	int bDescTrunc = 0;
 
-	if (m_bOwner && !IsWhitespace(m_sFields[FLD_OWNER]))
+	if (!bDefer && !bSkipped)
 	{
-		rDesc += "Owner: ";
-		rDesc += m_sFields[FLD_OWNER] + "\n";
-		bExtra = 1;
-	}
+		BuildDescription(bDescTrunc);
 
-	if (m_bDate && !IsWhitespace(m_sFields[FLD_DATETIME]))
+		if (!rDesc.empty())
+			m_bEmptyDesc = 0;
+
+		// If GPX description is kind of long and this isn't a cache
+		// file, treat it as the description instead
+		if (m_bNonCacheFile && rDesc.empty() &&
+				m_sFields[FLD_NAME].size() > 64)
+			m_bLongDesc = 1;
+	}
+
+	if (m_nRecords++ == 0)
+	{
+		m_bFirstNonCache = m_bNonCacheFile;
+		m_bFirstLongDesc = m_bLongDesc;
+	}
+
+	if (m_bLongDesc)
+	{
+		rDesc.swap(m_sFields[FLD_NAME]);
+		m_sFields[FLD_NAME] = m_sFields[FLD_WAYPOINT];
+	}
+
+	if (m_sFields[FLD_TYPE].compare(0, 9, "Waypoint|") == 0)
+		m_sFields[FLD_TYPE].erase(0, 9);
+
+	CWPData *pWP = m_pList->NewWP();
+	pWP->m_bTravelBugs = m_bHasBugs;
+	pWP->m_dLat = dLat;
+	pWP->m_dLon = dLon;
+	pWP->m_bActive = m_bCacheActive;
+
+	if (!bDefer && !bSkipped)
+		StoreRecord(pWP, bDescTrunc);
+
+	SwapListedFields(pWP);
+
+	if (bSkipped)
+	{
+		pWP->m_bFiltered = 1;
+
+		// Filtered fields that follow the descriptions may have
+		// changed the verdict
+		if (m_bNonCacheFile || m_pFilter->Matches(pWP, 0))
+			m_bFilterLate = 1;
+	}
+	else if (bDefer)
+	{	// Keep what the rest of the record is built from (the
+		// listed fields stay with the waypoint)
+		for (i=0; i<MAX_MID_FIELDS; i++)
+		{
+			if (!IsDeferredField(i) && !m_sFields[i].empty())
+				pRec->AddStep(DEFER_SET, i, 0, m_sFields[i]);
+		}
+
+		pWP->m_pDeferred = pRec;
+	}
+
+	m_pList->AddWP(pWP);
+}
+
+// Put the description field together from its parts (and encode hints)
+void CXMLParser::BuildDescription(int &rbTrunc)
+{
+	static const int aExtraFields[] = { FLD_OWNER, FLD_DATETIME,
+		FLD_LOCALE, FLD_STATE, FLD_COUNTRY, FLD_CONTAINER, FLD_BUGS,
+		FLD_STATUS, FLD_CACHE_ATTR, FLD_CAMO_DIFF };
+	int i;
+
+	rbTrunc = 0;
+
+	StripTags(m_sFields[FLD_HINTS]);
+	CUtil::StripWhitespace(m_sFields[FLD_HINTS]);
+	if (!m_bDecodeHints)
+		EncodeHints(FLD_HINTS);
+
+	string &rShort = m_sFields[FLD_SHRT_DESC];
+	string &rLong = m_sFields[FLD_LONG_DESC];
+	int bShort = !IsWhitespace(rShort);
+	int bLong = !IsWhitespace(rLong);
+	CUtil::StripWhitespace(rShort);
+	CUtil::StripWhitespace(rLong);
+
+	// Size the buffer up front for everything that could go in
+	size_t nSize = DESC_LABELS_MAX + rShort.size() + rLong.size();
+	for (i=0; i<(int)(sizeof(aExtraFields)/sizeof(int)); i++)
+		nSize += m_sFields[aExtraFields[i]].size();
+
+	string &rDesc = m_sFields[FLD_DESC];
+	rDesc.erase();
+	rDesc.reserve(nSize);
+
+	int bExtra = 0;
+
+	// CM2GPX-supported fields
+
+	if (m_bOwner && !IsWhitespace(m_sFields[FLD_OWNER]))
+	{
+		rDesc += "Owner: ";
+		rDesc += m_sFields[FLD_OWNER];
+		rDesc += "\n";
+		bExtra = 1;
+	}
+
+	if (m_bDate && !IsWhitespace(m_sFields[FLD_DATETIME]))
 	{
 		rDesc += "Date: ";
 
 		string &rDT = m_sFields[FLD_DATETIME];
 		int i = rDT.find('T');
 		if (i != string::npos)
-			rDT = rDT.substr(0, i);
+			rDT.erase(i);
 		ReformatDate(rDT);
 
 		rDesc += rDT;
@@ -1325,39 +2065,50 @@ void CXMLParser::FinishWaypointRecord()
 		rDesc += "Location: ";
 
 		if (!IsWhitespace(m_sFields[FLD_LOCALE]))
-			rDesc += m_sFields[FLD_LOCALE] + ", ";
+		{
+			rDesc += m_sFields[FLD_LOCALE];
+			rDesc += ", ";
+		}
 		if (!IsWhitespace(m_sFields[FLD_STATE]))
-			rDesc += m_sFields[FLD_STATE] + ", ";
+		{
+			rDesc += m_sFields[FLD_STATE];
+			rDesc += ", ";
+		}
 
-		rDesc += m_sFields[FLD_COUNTRY] + "\n";
+		rDesc += m_sFields[FLD_COUNTRY];
+		rDesc += "\n";
 		bExtra = 1;
 	}
 
 	if (m_bContainer && !IsWhitespace(m_sFields[FLD_CONTAINER]))
 	{
 		rDesc += "Container: ";
-		rDesc += m_sFields[FLD_CONTAINER] + "\n";
+		rDesc += m_sFields[FLD_CONTAINER];
+		rDesc += "\n";
 		bExtra = 1;
 	}
 
 	if (m_bShowBugs && !IsWhitespace(m_sFields[FLD_BUGS]))
 	{
 		rDesc += "Bugs: ";
-		rDesc += m_sFields[FLD_BUGS] + "\n";
+		rDesc += m_sFields[FLD_BUGS];
+		rDesc += "\n";
 		bExtra = 1;
 	}
 
 	if (m_bCacheStatus && !IsWhitespace(m_sFields[FLD_STATUS]))
 	{
 		rDesc += "Status: ";
-		rDesc += m_sFields[FLD_STATUS] + "\n";
+		rDesc += m_sFields[FLD_STATUS];
+		rDesc += "\n";
 		bExtra = 1;
 	}
 
 	if (!IsWhitespace(m_sFields[FLD_CACHE_ATTR]))
 	{
 		rDesc += "Attributes: ";
-		rDesc += m_sFields[FLD_CACHE_ATTR] + "\n";
+		rDesc += m_sFields[FLD_CACHE_ATTR];
+		rDesc += "\n";
 		bExtra = 1;
 	}
 
@@ -1370,219 +2121,597 @@ void CXMLParser::FinishWaypointRecord()
 			rDesc += "\n";
 
 		rDesc += "Camo challenge: ";
-		rDesc += m_sFields[FLD_CAMO_DIFF] + "\n";
+		rDesc += m_sFields[FLD_CAMO_DIFF];
+		rDesc += "\n";
 		bExtra2 = bExtra = 1;
 	}
 
 	if (bExtra)
 		rDesc += "\n";
 
-	CUtil::StripWhitespace(sDesc);
-	rDesc += sDesc;
+	if (bShort)
+	{
+		rDesc += rShort;
+		if (bLong)
+			rDesc += "\n\n";
+	}
+	if (bLong)
+		rDesc += rLong;
 
-	int bDescTrunc = 0;
 	if (rDesc.size() > m_nMaxDesc)
 	{
-		rDesc = rDesc.substr(0, m_nMaxDesc - 12);
+		rDesc.erase(m_nMaxDesc - 12);
 		rDesc += "\n[truncated]";
-		bDescTrunc = 1;
+		rbTrunc = 1;
 	}
+}
 
-	if (!rDesc.empty())
-		m_bEmptyDesc = 0;
+void CXMLParser::StoreRecord(CWPData *pWP, int bDescTrunc)
+{
+	int i;
 
-	if (!m_sFields[FLD_NAME2].empty())
-		m_sFields[FLD_NAME] = m_sFields[FLD_NAME2];
-	if (!m_sFields[FLD_TYPE2].empty())
-		m_sFields[FLD_TYPE] = m_sFields[FLD_TYPE2];
+	static const char szCmtLabel[] = "\n\nGPX Comment: ";
 
-	if (m_bStripNameQuotes)
-		StripQuotes(m_sFields[FLD_NAME]);
+	string &rDesc = m_sFields[FLD_DESC];
+	string &rCmt = m_sFields[FLD_COMMENT];
+	CUtil::StripWhitespace(rCmt);
 
-	CUtil::StripWhitespace(m_sFields[FLD_NAME]);
-	if (m_sFields[FLD_NAME].empty())
-		m_sFields[FLD_NAME] = "Geocache";
+	// The comment goes at the end of the description
+	size_t nCmtLabel = 0;
+	if (!rCmt.empty() && !rDesc.empty())
+		nCmtLabel = sizeof(szCmtLabel) - 1;
 
-	if (m_bLogTemplate)
-		m_sFields[FLD_NOTES] = "Took: \nLeft: \nTB: \n";
+	// Build the record straight into the waypoint, in one buffer
+	size_t nSize = MAX_END_FIELDS + nCmtLabel + rCmt.size();
+	for (i=0; i<MAX_END_FIELDS; i++)
+		nSize += m_sFields[i].size();
 
-	string sSym = m_sFields[FLD_SYMBOL];
-	CUtil::LowercaseString(sSym);
-	if (sSym.find("geocache") == string::npos)
+	char sep = 1;
+	string &rRecord = pWP->m_sRecord;
+	rRecord.erase();
+	rRecord.reserve(nSize);
+
+	for (i=0; i<MAX_END_FIELDS; i++)
 	{
-		string sType = m_sFields[FLD_TYPE];
-		CUtil::LowercaseString(sType);
-		if (sType.find("geocache") == string::npos)
-			m_bNonCacheFile = 1;
+		rRecord += m_sFields[i];
+		if (i == FLD_DESC)
+		{
+			rRecord.append(szCmtLabel, nCmtLabel);
+			rRecord += rCmt;
+		}
+		rRecord += sep;
 	}
 
-	// If GPX description is kind of long and this isn't a cache
-	// file, treat it as the description instead
-	if (m_bNonCacheFile && rDesc.empty() &&
-			m_sFields[FLD_NAME].size() > 64)
-		m_bLongDesc = 1;
+	pWP->m_bTruncated = bDescTrunc;
+	pWP->m_sURL.swap(m_sFields[FLD_URL]);
+	pWP->m_sLinks.swap(m_sFields[FLD_LINKS]);
+}
+
+// Trade the fields a waypoint is listed and filtered by with the
+// waypoint (they are never copied)
+void CXMLParser::SwapListedFields(CWPData *pWP)
+{
+	pWP->m_sWaypoint.swap(m_sFields[FLD_WAYPOINT]);
+	pWP->m_sDesc.swap(m_sFields[FLD_NAME]);
+	pWP->m_sDiff.swap(m_sFields[FLD_DIFFICULTY]);
+	pWP->m_sTerrain.swap(m_sFields[FLD_TERRAIN]);
+	pWP->m_sSymbol.swap(m_sFields[FLD_SYMBOL]);
+	pWP->m_sType.swap(m_sFields[FLD_TYPE]);
+	pWP->m_sContainer.swap(m_sFields[FLD_CONTAINER]);
+	pWP->m_sState.swap(m_sFields[FLD_STATE]);
+	pWP->m_sCountry.swap(m_sFields[FLD_COUNTRY]);
+	pWP->m_sOwner.swap(m_sFields[FLD_OWNER]);
+}
 
-	if (m_bLongDesc)
+void CXMLParser::FormatFileTS(string sPath)
+{
+	struct stat info;
+	struct tm *t;
+	char buf[32];
+
+	if (stat(sPath.c_str(), &info) < 0)
+		return;
+
+#if HAVE_GMTIME_R
+	struct tm tmi;
+	t = gmtime_r(&info.st_mtime, &tmi);
+#else
+	t = gmtime(&info.st_mtime);
+#endif
+	sprintf(buf, "%04d-%02d-%02dT%02d:%02d:%02dZ",
+		t->tm_year+1900, t->tm_mon+1, t->tm_mday, t->tm_hour,
+		t->tm_min, t->tm_sec);
+	m_sFileTS = buf;
+}
+
+void CXMLParser::ChooseChunkSize(string sPath)
+{
+	struct stat info;
+	long nSize = m_nReadSize;
+
+	if (nSize <= 0)
+	{	// Aim for a few hundred reads per file, in whole blocks
+		nSize = CHUNK_SIZE;
+		if (stat(sPath.c_str(), &info) == 0)
+		{
+			long nBlock = info.st_blksize;
+			if (nBlock < CHUNK_SIZE)
+				nBlock = CHUNK_SIZE;
+
+			nSize = (info.st_size / 256 / nBlock) * nBlock;
+			if (nSize < nBlock)
+				nSize = nBlock;
+			if (nSize > 256*1024)
+				nSize = 256*1024;
+		}
+	}
+
+	if (nSize < CHUNK_SIZE)
+		nSize = CHUNK_SIZE;
+	else if (nSize > MAX_CHUNK_SIZE)
+		nSize = MAX_CHUNK_SIZE;
+
+	m_nChunkSize = nSize;
+}
+
+// Returns -1 on read error, 0 on parse error
+int CXMLParser::ParseChunk(IXMLReader *pReader, CCharRefFilter &rFilter,
+	int &rbDone)
+{
+	char *pBuf;
+	int len;
+
+	if (!m_pMap)
+	{	// Read straight into Expat's buffer, past the filter's
+		// lookahead so it can work in place
+		pBuf = (char*)XML_GetBuffer(m_pExpat, m_nChunkSize);
+		if (!pBuf)
+			return 0;
+
+		char *pIn = pBuf + CHARREF_MAX;
+		len = pReader->Read(pIn, m_nChunkSize - CHARREF_MAX);
+		if (len < 0)
+			return -1;
+
+		rbDone = (len == 0);
+		if (rbDone)
+			len = rFilter.Flush(pBuf);
+		else
+			len = rFilter.Filter(pIn, len, pBuf);
+
+		return (XML_ParseBuffer(m_pExpat, len, rbDone) != 0);
+	}
+
+	// Mapped file: hand runs without character references straight
+	// to Expat, and only copy the references through the filter
+	len = (m_nMapLen - m_nMapPos > m_nChunkSize) ? m_nChunkSize :
+		(m_nMapLen - m_nMapPos);
+	const char *pIn = m_pMap + m_nMapPos;
+
+	rbDone = (len == 0);
+	if (!rbDone && !rFilter.Pending())
 	{
-		rDesc = m_sFields[FLD_NAME];
-		m_sFields[FLD_NAME] = m_sFields[FLD_WAYPOINT];
+		int nClean = CCharRefFilter::CleanLength(pIn, len);
+		if (nClean > 0)
+		{
+			m_nMapPos += nClean;
+			return (XML_Parse(m_pExpat, pIn, nClean, 0) != 0);
+		}
 	}
 
-	string &rCmt = m_sFields[FLD_COMMENT];
-	CUtil::StripWhitespace(rCmt);
-	if (!rCmt.empty())
+	pBuf = (char*)XML_GetBuffer(m_pExpat, CHARREF_MAX * 2);
+	if (!pBuf)
+		return 0;
+
+	if (rbDone)
+		len = rFilter.Flush(pBuf);
+	else
 	{
-		if (!rDesc.empty())
-			rDesc += "\n\nGPX Comment: ";
-		rDesc += rCmt;
+		if (len > CHARREF_MAX)
+			len = CHARREF_MAX;
+		m_nMapPos += len;
+
+		len = rFilter.Filter(pIn, len, pBuf);
 	}
 
-	if (m_sFields[FLD_TYPE].substr(0, 9) == "Waypoint|")
-		m_sFields[FLD_TYPE] = m_sFields[FLD_TYPE].substr(9);
+	return (XML_ParseBuffer(m_pExpat, len, rbDone) != 0);
+}
 
-	char sep = 1;
-	m_sRecord.erase();
+struct XML_ParserStruct* CXMLParser::CreateExpat()
+{
+	XML_Parser pParser = XML_ParserCreate(NULL);
+	if (!pParser)
+		return NULL;
 
-	for (i=0; i<MAX_END_FIELDS; i++)
-	{
-		m_sRecord += m_sFields[i];
-		m_sRecord += sep;
-	}
-
-	CWPData *pWP = new CWPData();
-	pWP->m_sRecord = m_sRecord;
-	pWP->m_sWaypoint = m_sFields[FLD_WAYPOINT];
-	pWP->m_sDesc = m_sFields[FLD_NAME];
-	pWP->m_sDiff = m_sFields[FLD_DIFFICULTY];
-	pWP->m_sTerrain = m_sFields[FLD_TERRAIN];
-	pWP->m_sSymbol = m_sFields[FLD_SYMBOL];
-	pWP->m_sType = m_sFields[FLD_TYPE];
-	pWP->m_sContainer = m_sFields[FLD_CONTAINER];
-	pWP->m_sState = m_sFields[FLD_STATE];
-	pWP->m_sCountry = m_sFields[FLD_COUNTRY];
-	pWP->m_sOwner = m_sFields[FLD_OWNER];
-	pWP->m_bTravelBugs = m_bHasBugs;
-	pWP->m_dLat = dLat;
-	pWP->m_dLon = dLon;
-	pWP->m_bTruncated = bDescTrunc;
-	pWP->m_sURL = m_sFields[FLD_URL];
-	pWP->m_sLinks = m_sFields[FLD_LINKS];
-	pWP->m_bActive = m_bCacheActive;
-	m_pList->AddWP(pWP);
+	XML_SetUserData(pParser, this);
+	XML_SetElementHandler(pParser, CXMLParser::HandleElemStart,
+		CXMLParser::HandleElemEnd);
+	XML_SetCharacterDataHandler(pParser, CXMLParser::HandleCharData);
+
+	return pParser;
 }
 
-int CXMLParser::CheckCharVal(char *pVal)
+void CXMLParser::CopyOptions(const CXMLParser &rParser)
 {
-	u_long val;
-	int legal = 0;
+	m_bLocation = rParser.m_bLocation;
+	m_bContainer = rParser.m_bContainer;
+	m_bOwner = rParser.m_bOwner;
+	m_bDate = rParser.m_bDate;
+	m_bShowBugs = rParser.m_bShowBugs;
+	m_bDecodeHints = rParser.m_bDecodeHints;
+	m_nMaxLogs = rParser.m_nMaxLogs;
+	m_nMaxDesc = rParser.m_nMaxDesc;
+	m_bLogTemplate = rParser.m_bLogTemplate;
+	m_bQuiet = rParser.m_bQuiet;
+	m_bCacheStatus = rParser.m_bCacheStatus;
+	m_bStripNameQuotes = rParser.m_bStripNameQuotes;
+	m_nReadSize = rParser.m_nReadSize;
+	m_nChunkSize = rParser.m_nChunkSize;
+	m_bDeferRecords = rParser.m_bDeferRecords;
+	m_pFilter = rParser.m_pFilter;
+}
 
-	if (pVal[0] == 'x')
-		val = strtoul(&pVal[1], NULL, 16);
-	else
-		val = strtoul(pVal, NULL, 10);
+// Feed a block of memory to Expat; the final block ends the document
+int CXMLParser::ParseSpan(CCharRefFilter &rFilter, const char *pData,
+	long nLen, int bFinal)
+{
+	m_pMap = pData;
+	m_nMapLen = nLen;
+	m_nMapPos = 0;
 
-	if (val < 32)
+	for (;;)
 	{
-		if (val == 9 || val == 10 || val == 13)
-			legal = 1;
+		int bDone;
+
+		if (!bFinal && m_nMapPos == m_nMapLen)
+			return 1;
+
+		if (ParseChunk(NULL, rFilter, bDone) <= 0)
+			return 0;
+
+		if (bDone)
+			return 1;
 	}
-	else
-		legal = 1;
+}
+
+int CXMLParser::ParseSegment(stSegment &rSeg)
+{
+	CCharRefFilter filter;
+
+	m_pExpat = CreateExpat();
+	if (!m_pExpat)
+		return 0;
 
-	return legal;
+	int bParsed = ParseSpan(filter, rSeg.pMap, rSeg.nPrefixLen, 0) &&
+		ParseSpan(filter, rSeg.pMap + rSeg.nStart,
+			rSeg.nEnd - rSeg.nStart, 0) &&
+		ParseSpan(filter, rSeg.sClose.data(), rSeg.sClose.size(), 1);
+
+	XML_ParserFree(m_pExpat);
+	m_pExpat = NULL;
+
+	return bParsed;
 }
 
-void CXMLParser::CleanCharRefs(char *szBuf)
+void* CXMLParser::SegmentThread(void *pArg)
 {
-	char *pRef, *pEnd;
+	stSegment *pSeg = (stSegment*)pArg;
+
+	pSeg->bParsed = pSeg->pParser->ParseSegment(*pSeg);
+	return NULL;
+}
+
+// Would this segment have parsed the same way if it had followed the
+// rest of the file, given the state the earlier segments left behind?
+int CXMLParser::CanStartFrom(stExtMap *pExt, int bNonCache, int bLongDesc)
+{
+	if (pExt && (m_bExtMissed ||
+			(m_pExtensions && m_pExtensions != pExt)))
+		return 0;
+
+	// These only matter from the first waypoint on, where the
+	// segment may have set them itself
+	if (m_nRecords > 0 && ((bNonCache && !m_bFirstNonCache) ||
+			(bLongDesc && !m_bFirstLongDesc)))
+		return 0;
 
-	pRef = strstr(szBuf, "&#");
-	while (pRef)
+	return 1;
+}
+
+#if HAVE_PTHREAD_H && HAVE_LIBPTHREAD
+// Parse a mapped file in pieces on several threads.  Returns 0 if the
+// file should be parsed whole instead.
+int CXMLParser::ParseSplit()
+{
+	int nParts = m_nJobs;
+	if (nParts > m_nMapLen / SPLIT_MIN_SIZE)
+		nParts = m_nMapLen / SPLIT_MIN_SIZE;
+	if (nParts < 2)
+		return 0;
+
+	CGPXSplitter splitter(m_pMap, m_nMapLen);
+	if (!splitter.Split(nParts))
+		return 0;
+
+	nParts = splitter.m_Points.size() - 1;
+	vector<stSegment> segs(nParts);
+
+	int i;
+	for (i=0; i<nParts; i++)
+	{
+		stSegment &rSeg = segs[i];
+		rSeg.pParser = new CXMLParser;
+		rSeg.pParser->CopyOptions(*this);
+		rSeg.pParser->m_pList = new CWPList;
+		rSeg.pMap = m_pMap;
+		rSeg.nPrefixLen = (i > 0) ? splitter.m_nRootEnd : 0;
+		rSeg.nStart = splitter.m_Points[i];
+		rSeg.nEnd = splitter.m_Points[i+1];
+		if (i < nParts - 1)
+			rSeg.sClose = splitter.m_sRootClose;
+		rSeg.bParsed = 0;
+	}
+
+	vector<pthread_t> threads(nParts);
+	vector<int> started(nParts, 0);
+	for (i=1; i<nParts; i++)
+		started[i] = (pthread_create(&threads[i], NULL,
+			CXMLParser::SegmentThread, &segs[i]) == 0);
+
+	SegmentThread(&segs[0]);
+	for (i=1; i<nParts; i++)
+	{
+		if (started[i])
+			pthread_join(threads[i], NULL);
+		else
+			SegmentThread(&segs[i]);
+	}
+
+	// Check each segment against the state the ones before it left,
+	// and parse it again from that state if it doesn't fit
+	stExtMap *pExt = NULL;
+	int nPathSet = 0, bNonCache = 0, bLongDesc = 0;
+	int bSuccess = 1;
+
+	for (i=0; i<nParts && bSuccess; i++)
 	{
-		pEnd = strchr(pRef, ';');
-		if (!pEnd)
+		CXMLParser *pSeg = segs[i].pParser;
+
+		if (segs[i].bParsed &&
+				!pSeg->CanStartFrom(pExt, bNonCache, bLongDesc))
 		{
-			*pRef = 0;
-			break;
+			delete pSeg->m_pList;
+			delete pSeg;
+
+			pSeg = segs[i].pParser = new CXMLParser;
+			pSeg->CopyOptions(*this);
+			pSeg->m_pList = new CWPList;
+			pSeg->m_pExtensions = pExt;
+			pSeg->m_nPathSet = nPathSet;
+			pSeg->m_bNonCacheFile = bNonCache;
+			pSeg->m_bLongDesc = bLongDesc;
+			segs[i].bParsed = pSeg->ParseSegment(segs[i]);
 		}
 
-		pEnd++;
+		if (!segs[i].bParsed)
+		{
+			bSuccess = 0;
+			break;
+		}
 
-		if (!CheckCharVal(&pRef[2]))
-			strcpy(pRef, pEnd);
-		else
-			pRef = pEnd;
+		if (!pExt && pSeg->m_pExtensions)
+		{
+			pExt = pSeg->m_pExtensions;
+			nPathSet = pSeg->m_nPathSet;
+		}
 
-		pRef = strstr(pRef, "&#");
+		bNonCache |= pSeg->m_bNonCacheFile;
+		bLongDesc |= pSeg->m_bLongDesc;
 	}
-}
 
-void CXMLParser::FormatFileTS(string sPath)
-{
-	struct stat info;
-	struct tm *t;
-	char buf[32];
+	for (i=0; i<nParts; i++)
+	{
+		CXMLParser *pSeg = segs[i].pParser;
 
-	if (stat(sPath.c_str(), &info) < 0)
-		return;
+		if (bSuccess)
+		{
+			m_pList->AppendList(pSeg->m_pList);
+
+			m_bLocWarning |= pSeg->m_bLocWarning;
+			m_bFilterLate |= pSeg->m_bFilterLate;
+			m_nLogsSkipped += pSeg->m_nLogsSkipped;
+			m_nLogBytesSkipped += pSeg->m_nLogBytesSkipped;
+			if (!pSeg->m_bEmptyDesc)
+				m_bEmptyDesc = 0;
+			if (pSeg->m_bFileTSSet)
+				m_sFileTS = pSeg->m_sFileTS;
+		}
 
-	t = gmtime(&info.st_mtime);
-	sprintf(buf, "%04d-%02d-%02dT%02d:%02d:%02dZ",
-		t->tm_year+1900, t->tm_mon+1, t->tm_mday, t->tm_hour,
-		t->tm_min, t->tm_sec);
-	m_sFileTS = buf;
+		delete pSeg->m_pList;
+		delete pSeg;
+	}
+
+	if (bSuccess)
+	{
+		m_pExtensions = pExt;
+		m_nPathSet = nPathSet;
+		m_bNonCacheFile = bNonCache;
+		m_bLongDesc = bLongDesc;
+	}
+
+	return bSuccess;
 }
+#endif
 
-int CXMLParser::ParseFile(string sPath, IXMLReader *pReader)
+int CXMLParser::ParseChunks(IXMLReader *pReader)
 {
-	int bError = 0;
+	CCharRefFilter filter;
 
-	FormatFileTS(sPath);
-
-	XML_Parser pParser = XML_ParserCreate(NULL);
-	if (!pParser)
+	for (;;)
 	{
-		printf("Couldn't allocate parser.\n");
-		return 0;
+		int nStatus, bDone;
+
+		nStatus = ParseChunk(pReader, filter, bDone);
+		if (nStatus <= 0 || bDone)
+			return nStatus;
 	}
+}
 
-	XML_SetUserData(pParser, this);
-	XML_SetElementHandler(pParser, CXMLParser::HandleElemStart,
-		CXMLParser::HandleElemEnd);
-	XML_SetCharacterDataHandler(pParser, CXMLParser::HandleCharData);
+#if HAVE_PTHREAD_H && HAVE_LIBPTHREAD
+// Reader stage of the pipeline: read (or inflate) the input and filter
+// character references into ring slots
+void* CXMLParser::ReadThread(void *pArg)
+{
+	stPipe *pPipe = (stPipe*)pArg;
+	CBufferRing *pRing = pPipe->pRing;
+	CCharRefFilter filter;
 
 	for (;;)
 	{
-		int len;
+		char *pBuf = pRing->GetFree();
+		if (!pBuf)
+			break;
 
-		len = pReader->Read(m_buf, CHUNK_SIZE-1);
-		m_buf[len] = 0;
+		char *pIn = pBuf + CHARREF_MAX;
+		int len = pPipe->pReader->Read(pIn,
+			pRing->SlotSize() - CHARREF_MAX);
 		if (len < 0)
 		{
-			bError = 1;
-			printf("Error reading input file.\n");
+			pPipe->bReadError = 1;
+			pRing->Publish(0, 1);
 			break;
 		}
 
-		CleanCharRefs(m_buf);
-		len = strlen(m_buf);
-		if (!XML_Parse(pParser, m_buf, len, len == 0))
+		if (len == 0)
 		{
-			bError = 1;
-			printf("Parse error at line %d:\n%s\n",
-				(int)XML_GetCurrentLineNumber(pParser),
-				XML_ErrorString(XML_GetErrorCode(pParser)));
+			pRing->Publish(filter.Flush(pBuf), 1);
 			break;
 		}
 
-		if (len == 0)
+		pRing->Publish(filter.Filter(pIn, len, pBuf), 0);
+	}
+
+	return NULL;
+}
+
+// Parse a streamed input with reading and inflating done on a second
+// thread, so I/O and zlib overlap with Expat
+int CXMLParser::ParsePipelined(IXMLReader *pReader)
+{
+	CBufferRing ring(RING_SLOTS, m_nChunkSize);
+	stPipe pipe;
+	pthread_t thread;
+
+	pipe.pRing = &ring;
+	pipe.pReader = pReader;
+	pipe.bReadError = 0;
+
+	if (pthread_create(&thread, NULL, CXMLParser::ReadThread, &pipe) != 0)
+		return ParseChunks(pReader);
+
+	int nStatus = 1;
+	for (;;)
+	{
+		int len, bLast;
+		const char *pBuf = ring.GetFull(len, bLast);
+
+		if (!bLast || !pipe.bReadError)
+			nStatus = (XML_Parse(m_pExpat, pBuf, len, bLast) != 0);
+		ring.Release();
+
+		if (!nStatus || bLast)
 			break;
 	}
 
+	if (!nStatus)
+		ring.Cancel();
+	pthread_join(thread, NULL);
+
+	if (pipe.bReadError)
+		return -1;
+
+	return nStatus;
+}
+#endif
+
+int CXMLParser::ParseWhole(IXMLReader *pReader)
+{
+	XML_Parser pParser = CreateExpat();
+	if (!pParser)
+	{
+		printf("Couldn't allocate parser.\n");
+		return 0;
+	}
+
+	m_pExpat = pParser;
+
+	int nStatus;
+#if HAVE_PTHREAD_H && HAVE_LIBPTHREAD
+	if (!m_pMap)
+		nStatus = ParsePipelined(pReader);
+	else
+#endif
+		nStatus = ParseChunks(pReader);
+
+	if (nStatus < 0)
+		printf("Error reading input file.\n");
+	else if (!nStatus)
+	{
+		printf("Parse error at line %d:\n%s\n",
+			(int)XML_GetCurrentLineNumber(pParser),
+			XML_ErrorString(XML_GetErrorCode(pParser)));
+	}
+
 	XML_ParserFree(pParser);
+	m_pExpat = NULL;
+
+	return (nStatus > 0);
+}
+
+int CXMLParser::ParseFile(string sPath, IXMLReader *pReader)
+{
+	int bSplit = 0;
+
+	FormatFileTS(sPath);
+	ChooseChunkSize(sPath);
+
+	m_pMap = NULL;
+	m_nMapLen = m_nMapPos = 0;
+	pReader->GetMapping(m_pMap, m_nMapLen);
+
+	// Waypoints are only dropped early from input that can be read
+	// again if that turns out to be wrong
+	if (!m_pMap)
+		m_pFilter = NULL;
+
+#if HAVE_PTHREAD_H && HAVE_LIBPTHREAD
+	if (m_pMap && m_nJobs > 1)
+		bSplit = ParseSplit();
+#endif
+
+	if (!bSplit && !ParseWhole(pReader))
+		return 0;
+
+	if (m_bFilterLate)
+	{	// Start over without dropping anything early
+		CXMLParser parser;
+		parser.CopyOptions(*this);
+		parser.m_nJobs = m_nJobs;
+		parser.m_pFilter = NULL;
+		parser.m_pList = m_pList;
+		m_pList->Clear();
+
+		int bParsed = parser.ParseFile(sPath, pReader);
+		m_sFileTS = parser.m_sFileTS;
+		m_bLocWarning = parser.m_bLocWarning;
+		m_bEmptyDesc = parser.m_bEmptyDesc;
+		m_nLogsSkipped = parser.m_nLogsSkipped;
+		m_nLogBytesSkipped = parser.m_nLogBytesSkipped;
+		return bParsed;
+	}
 
 	if (m_bLocWarning || m_bNonCacheFile || (m_pList->m_List.size() == 0))
 		m_bEmptyDesc = 0;
 
-	return (bError != 1);
+	return 1;
 }
@@ -20,10 +20,24 @@
 #ifndef _PARSER_H_INCLUDED_
 #define _PARSER_H_INCLUDED_
 
+// Range of input chunk sizes (the default is picked per file)
 #define CHUNK_SIZE 8192
+#define MAX_CHUNK_SIZE (4*1024*1024)
 #define MAX_LOGS_SIZE 8192
+#define MAX_LOG_SIZE 3072
+// Most a cache log grows by, beyond the size of its fields
+#define LOG_HEADER_MAX 96
+// Most the labels of the extra fields add to a description
+#define DESC_LABELS_MAX 128
+#define MAX_PATH_DEPTH 64
+// Longest decoded entity ("..." for &hellip;)
+#define ENTITY_VALUE_MAX 4
+// Smallest piece of a file worth parsing on its own thread
+#define SPLIT_MIN_SIZE (1024*1024)
 
 #include "wplist.h"
+#include "pathtrie.h"
+#include "filter.h"
 
 // Field indices
 #define FLD_NAME	0
@@ -67,29 +81,67 @@
 #define MAX_END_FIELDS	10
 #define MAX_MID_FIELDS	37
 
-// XPath-to-field mapping
-typedef struct
-{
-	const char *szName;
-	int nField;
-	int32_t nFlags;
-} stPathMap;
+// Steps replayed when a deferred record is finished
+#define DEFER_SET	0	// Store field data (converting HTML)
+#define DEFER_LINK	1	// Add link to record
+#define DEFER_LOG_START	2	// Clear log fields
+#define DEFER_LOG_END	3	// Compile cache log
 
-// NamespaceURL-to-PathMap mapping
-typedef struct
-{
-	const char *szURI;
-	int bPrefix;
-	const char *szExtElem;
-	stPathMap *pMap;
-} stExtMap;
+// Conversions of the data of a DEFER_SET step
+#define DEFER_UTF8	1
+#define DEFER_HTML	2
+#define DEFER_HTML_STRIP 4
 
 class IXMLReader;
+class CCharRefFilter;
+class CBufferRing;
+struct XML_ParserStruct;
+class CXMLParser;
+
+// Raw data of a waypoint, kept for conversion once it is known that
+// the waypoint passed the filters
+class CDeferredRecord : public IDeferredRecord
+{
+public:
+	CDeferredRecord(const CXMLParser &rParser);
+
+	virtual void Finish(CWPData *pWP);
+	virtual int SameInput(IDeferredRecord *pOther);
+
+	void AddStep(int nType);
+	void AddStep(int nType, int nField, int nConvert, string &rData);
+
+private:
+	typedef struct
+	{
+		int nType;
+		int nField;
+		int nConvert;
+		string sData;
+	} stStep;
+	typedef vector<stStep> StepList;
+
+	friend class CXMLParser;
+
+	StepList m_Steps;
+
+	// Parser options used in finishing the record
+	int m_bLocation;
+	int m_bContainer;
+	int m_bOwner;
+	int m_bDate;
+	int m_bShowBugs;
+	int m_bDecodeHints;
+	int m_nMaxLogs;
+	int m_nMaxDesc;
+	int m_bCacheStatus;
+};
 
 class CXMLParser
 {
 public:
 	CXMLParser();
+	~CXMLParser();
 
 	CWPList *m_pList;
 
@@ -97,6 +149,10 @@ public:
 	int m_bEmptyDesc;
 	string m_sFileTS;
 
+	// Cache logs beyond the -N limit that were never read
+	long m_nLogsSkipped;
+	long m_nLogBytesSkipped;
+
 	// Parser options from command line
 	int m_bLocation;
 	int m_bContainer;
@@ -110,14 +166,42 @@ public:
 	int m_bQuiet;
 	int m_bCacheStatus;
 	int m_bStripNameQuotes;
+	int m_nReadSize;
+	int m_nJobs;
+	int m_bDeferRecords;
+	CWPFilter *m_pFilter;
 
 	int ParseFile(string sPath, IXMLReader *pReader);
 
 private:
-	string m_sCurTag, m_sCurData;
-	char m_buf[CHUNK_SIZE];
-	string m_sRecord;
-	string m_sCurPath;
+	// Byte range of a mapped file parsed by one thread
+	typedef struct
+	{
+		CXMLParser *pParser;
+		const char *pMap;
+		long nPrefixLen;
+		long nStart, nEnd;
+		string sClose;
+		int bParsed;
+	} stSegment;
+
+	// Shared with the reader thread of a pipelined parse
+	typedef struct
+	{
+		CBufferRing *pRing;
+		IXMLReader *pReader;
+		int bReadError;
+	} stPipe;
+
+	string m_sCurData;
+	struct XML_ParserStruct *m_pExpat;
+	int m_nChunkSize;
+	const char *m_pMap;
+	long m_nMapLen, m_nMapPos;
+	int m_nCurNode;
+	int m_aNodeStack[MAX_PATH_DEPTH];
+	int m_nDepth;
+	int m_bCapture;
 	string m_sFields[MAX_MID_FIELDS];
 	int m_nCurLogs;
 	int m_bHasBugs;
@@ -128,7 +212,34 @@ private:
 	stExtMap *m_pExtensions;
 	int m_bInclAttr;
 	int m_bHtmlFlag;
-	string m_sExtBase;
+	int m_nPathSet;
+	int m_bFileTSSet;
+
+	// What a segment saw of state carried between waypoints
+	int m_bExtMissed;
+	int m_nRecords;
+	int m_bFirstNonCache;
+	int m_bFirstLongDesc;
+
+	// Steps of the current waypoint, if its conversion is deferred
+	CDeferredRecord *m_pDeferred;
+
+	// Filtering while parsing (m_bFilterLate is set when a waypoint
+	// was skipped before all of its filtered fields were read)
+	int m_bSkipWaypoint;
+	int m_bFilterChecked;
+	int m_bFilterLate;
+
+	// Skipping a cache log past the limit (m_nSkipDepth is the depth
+	// of its element, or 0), and what bounds the size of the logs of
+	// a deferred record
+	int m_nSkipDepth;
+	long m_nSkipStart;
+	int m_nLogsSeen;
+	int m_nLogsBound;
+	int m_nLogBytes;
+
+	friend class CDeferredRecord;
 
 	static void HandleElemStart(void *data, const char *el, const char 
 		**attr);
@@ -144,8 +255,19 @@ private:
 	void ClearWaypoint();
 	void EncodeHints(int nField);
 	void FinishWaypointRecord();
-	void HTMLToText(string &sStr);
-	void DecodeEntity(string &sEnt, string &sValue);
+	void BuildDescription(int &rbTrunc);
+	void StoreRecord(CWPData *pWP, int bDescTrunc);
+	void SwapListedFields(CWPData *pWP);
+	void FinishDeferred(CDeferredRecord *pRec, CWPData *pWP);
+	void ReplaySteps(CDeferredRecord *pRec);
+	void DeferField(int nField);
+	void DeferElemData(int nField, int32_t nFlags);
+	static int IsDeferredField(int nField);
+	void StartCacheLog();
+	int CanSkipCacheLog();
+	void CheckFilter();
+	void HTMLToText(string &sStr, int bStripTags);
+	int DecodeEntity(const char *szEnt, char *pValue);
 	void ConvertCoords(string &sLat, string &sLon, string &sCoord,
 		double &dLat, double &dLon);
 	void StripQuotes(string &rStr);
@@ -158,10 +280,23 @@ private:
 	void FormatFileTS(string sPath);
 	void AddLinkToRecord(string sURL);
 	void CheckForGPXExtensions(const char **attr);
-	int GetElementInfo(string sPath, int &rField, int32_t &rFlags);
-
-	void CleanCharRefs(char *szBuf);
-	int CheckCharVal(char *pVal);
+	int GetElementInfo(int nNode, int &rField, int32_t &rFlags);
+	void ChooseChunkSize(string sPath);
+	int ParseChunk(IXMLReader *pReader, CCharRefFilter &rFilter,
+		int &rbDone);
+	int WantsCharData(int nNode);
+	struct XML_ParserStruct* CreateExpat();
+	void CopyOptions(const CXMLParser &rParser);
+	int ParseSpan(CCharRefFilter &rFilter, const char *pData, long nLen,
+		int bFinal);
+	int ParseSegment(stSegment &rSeg);
+	int CanStartFrom(stExtMap *pExt, int bNonCache, int bLongDesc);
+	int ParseSplit();
+	int ParseWhole(IXMLReader *pReader);
+	int ParseChunks(IXMLReader *pReader);
+	int ParsePipelined(IXMLReader *pReader);
+	static void* ReadThread(void *pArg);
+	static void* SegmentThread(void *pArg);
 };
 
 #endif // _PARSER_H_INCLUDED_
@@ -0,0 +1,199 @@
+/*
+    Copyright 2003-2010 Brian Smith (brian@smittyware.com)
+    This file is part of CMConvert.
+
+    CMConvert is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    CMConvert is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with CMConvert; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+*/
+
+#include "common.h"
+#include "pathtrie.h"
+
+// Slots in the element name hash (power of two, well above the number
+// of distinct names in all maps)
+#define NAME_HASH_SIZE	256
+
+CPathTrie::CPathTrie(const stPathMap *pBase, const stExtMap *pExt)
+{
+	int nExt = 0;
+	while (pExt[nExt].szURI)
+		nExt++;
+
+	m_nSets = ExtensionSet(nExt, 0);
+	m_NameHash.resize(NAME_HASH_SIZE, ELEM_NONE);
+	AddNode(ELEM_NONE);	// Root
+
+	AddMap("", pBase, 0);
+
+	int i;
+	for (i=0; i<nExt; i++)
+	{
+		string sBase;
+
+		sBase = "/gpx/wpt";
+		sBase += pExt[i].szExtElem;
+		AddMap(sBase.c_str(), pExt[i].pMap, ExtensionSet(i, 0));
+
+		sBase = "/gpx/wpt/extensions";
+		sBase += pExt[i].szExtElem;
+		AddMap(sBase.c_str(), pExt[i].pMap, ExtensionSet(i, 1));
+	}
+}
+
+uint32_t CPathTrie::HashName(const char *szElem, size_t nLen)
+{
+	uint32_t h = 2166136261U;	// FNV-1a
+
+	while (nLen--)
+	{
+		h ^= (unsigned char)(*szElem++);
+		h *= 16777619U;
+	}
+
+	return h;
+}
+
+int CPathTrie::AddName(const char *szElem, size_t nLen)
+{
+	uint32_t h = HashName(szElem, nLen) & (NAME_HASH_SIZE - 1);
+
+	while (m_NameHash[h] != ELEM_NONE)
+	{
+		const string &rName = m_Names[m_NameHash[h]];
+		if (rName.size() == nLen &&
+				!rName.compare(0, nLen, szElem, nLen))
+			return m_NameHash[h];
+
+		h = (h + 1) & (NAME_HASH_SIZE - 1);
+	}
+
+	m_Names.push_back(string(szElem, nLen));
+	m_NameHash[h] = m_Names.size() - 1;
+	return m_NameHash[h];
+}
+
+int CPathTrie::InternName(const char *szElem) const
+{
+	size_t nLen = strlen(szElem);
+	uint32_t h = HashName(szElem, nLen) & (NAME_HASH_SIZE - 1);
+
+	while (m_NameHash[h] != ELEM_NONE)
+	{
+		const string &rName = m_Names[m_NameHash[h]];
+		if (rName.size() == nLen && !memcmp(rName.data(), szElem, nLen))
+			return m_NameHash[h];
+
+		h = (h + 1) & (NAME_HASH_SIZE - 1);
+	}
+
+	return ELEM_NONE;
+}
+
+int CPathTrie::AddNode(int nElem)
+{
+	stNode node;
+	node.nElem = nElem;
+	node.nFirstChild = PATH_NONE;
+	node.nNextSibling = PATH_NONE;
+	node.aMaps.resize(m_nSets, NULL);
+
+	m_Nodes.push_back(node);
+	return m_Nodes.size() - 1;
+}
+
+int CPathTrie::AddPath(int nNode, const char *szPath)
+{
+	while (*szPath == '/')
+	{
+		const char *szElem = szPath + 1;
+		const char *szEnd = strchr(szElem, '/');
+		size_t nLen = szEnd ? (szEnd - szElem) : strlen(szElem);
+		int nElem = AddName(szElem, nLen);
+
+		int nChild = m_Nodes[nNode].nFirstChild;
+		while (nChild != PATH_NONE && m_Nodes[nChild].nElem != nElem)
+			nChild = m_Nodes[nChild].nNextSibling;
+
+		if (nChild == PATH_NONE)
+		{
+			nChild = AddNode(nElem);
+			m_Nodes[nChild].nNextSibling = m_Nodes[nNode].nFirstChild;
+			m_Nodes[nNode].nFirstChild = nChild;
+		}
+
+		nNode = nChild;
+		szPath = szElem + nLen;
+	}
+
+	return nNode;
+}
+
+void CPathTrie::AddMap(const char *szBase, const stPathMap *pMap, int nSet)
+{
+	int nBase = AddPath(PATH_ROOT, szBase);
+
+	while (pMap->szName)
+	{
+		int nNode = AddPath(nBase, pMap->szName);
+		if (!m_Nodes[nNode].aMaps[nSet])
+			m_Nodes[nNode].aMaps[nSet] = pMap;
+
+		pMap++;
+	}
+}
+
+int CPathTrie::Step(int nNode, int nElem) const
+{
+	if (nNode == PATH_NONE || nElem == ELEM_NONE)
+		return PATH_NONE;
+
+	int nChild = m_Nodes[nNode].nFirstChild;
+	while (nChild != PATH_NONE)
+	{
+		if (m_Nodes[nChild].nElem == nElem)
+			return nChild;
+
+		nChild = m_Nodes[nChild].nNextSibling;
+	}
+
+	return PATH_NONE;
+}
+
+const stPathMap* CPathTrie::Lookup(int nNode, int nSet) const
+{
+	if (nNode == PATH_NONE)
+		return NULL;
+
+	// Base map entries take precedence over extensions
+	const vector<const stPathMap*> &rMaps = m_Nodes[nNode].aMaps;
+	if (rMaps[0] || nSet <= 0)
+		return rMaps[0];
+
+	return rMaps[nSet];
+}
+
+int CPathTrie::HasExtension(int nNode) const
+{
+	if (nNode == PATH_NONE)
+		return 0;
+
+	int i;
+	for (i=1; i<m_nSets; i++)
+	{
+		if (m_Nodes[nNode].aMaps[i])
+			return 1;
+	}
+
+	return 0;
+}
@@ -0,0 +1,88 @@
+/*
+    Copyright 2003-2010 Brian Smith (brian@smittyware.com)
+    This file is part of CMConvert.
+
+    CMConvert is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    CMConvert is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with CMConvert; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+*/
+
+#ifndef _PATHTRIE_H_INCLUDED_
+#define _PATHTRIE_H_INCLUDED_
+
+// XPath-to-field mapping
+typedef struct
+{
+	const char *szName;
+	int nField;
+	int32_t nFlags;
+} stPathMap;
+
+// NamespaceURL-to-PathMap mapping
+typedef struct
+{
+	const char *szURI;
+	int bPrefix;
+	const char *szExtElem;
+	stPathMap *pMap;
+} stExtMap;
+
+// Node index for paths that match nothing in any map
+#define PATH_NONE	(-1)
+// Node index of the document root
+#define PATH_ROOT	0
+// Interned ID for element names that appear in no map
+#define ELEM_NONE	(-1)
+
+// Element path automaton, compiled once from the path maps.  Each node
+// is one element path; a tag costs one transition from its parent.
+class CPathTrie
+{
+public:
+	CPathTrie(const stPathMap *pBase, const stExtMap *pExt);
+
+	// Mapping set for an extension (base element with/without
+	// GPX 1.1 <extensions>); set 0 is the base map alone
+	static int ExtensionSet(int nExt, int bExtElem)
+		{ return 1 + (nExt * 2) + (bExtElem ? 1 : 0); }
+
+	int InternName(const char *szElem) const;
+	int Step(int nNode, int nElem) const;
+	const stPathMap* Lookup(int nNode, int nSet) const;
+	// Whether any extension maps the node
+	int HasExtension(int nNode) const;
+
+private:
+	typedef struct
+	{
+		int nElem;
+		int nFirstChild;
+		int nNextSibling;
+		vector<const stPathMap*> aMaps;
+	} stNode;
+
+	vector<stNode> m_Nodes;
+	int m_nSets;
+
+	// Element names, with an open-addressed hash of their IDs
+	vector<string> m_Names;
+	vector<int> m_NameHash;
+
+	static uint32_t HashName(const char *szElem, size_t nLen);
+	int AddName(const char *szElem, size_t nLen);
+	int AddNode(int nElem);
+	int AddPath(int nNode, const char *szPath);
+	void AddMap(const char *szBase, const stPathMap *pMap, int nSet);
+};
+
+#endif // _PATHTRIE_H_INCLUDED_
@@ -0,0 +1,247 @@
+/*
+    Copyright 2003-2010 Brian Smith (brian@smittyware.com)
+    This file is part of CMConvert.
+
+    CMConvert is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    CMConvert is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with CMConvert; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+*/
+
+// Checks the distance filter against CWPFilter::CheckRadius, both
+// through the box test while parsing and through MarkInRadius (the
+// grid and the batch haversine) once the list is complete.  Run by
+// "make check".
+
+#include "common.h"
+#include "wplist.h"
+#include "filter.h"
+
+#ifdef HAVE_LIBM
+
+static double Random(double dMin, double dMax)
+{
+	return dMin + (dMax - dMin) * rand() / RAND_MAX;
+}
+
+// Point dDist radians from a center on the given bearing, in degrees
+// (the longitude brought into [-180, 180))
+static void Destination(double dLat, double dLon, double dDist,
+	double dBearing, double &rLat, double &rLon)
+{
+	dLat *= RAD_PER_DEG;
+	dLon *= RAD_PER_DEG;
+
+	double dLat2 = asin(sin(dLat) * cos(dDist) +
+		cos(dLat) * sin(dDist) * cos(dBearing));
+	double dLon2 = dLon + atan2(sin(dBearing) * sin(dDist) * cos(dLat),
+		cos(dDist) - sin(dLat) * sin(dLat2));
+
+	rLat = dLat2 / RAD_PER_DEG;
+	if (rLat > 90.0)
+		rLat = 90.0;
+	else if (rLat < -90.0)
+		rLat = -90.0;
+
+	rLon = fmod(dLon2 / RAD_PER_DEG + 540.0, 360.0) - 180.0;
+}
+
+static void AddPoint(CWPList &rList, double dLat, double dLon)
+{
+	char szName[16];
+	sprintf(szName, "P%06d", (int)rList.m_List.size());
+
+	CWPData *pWP = rList.NewWP();
+	pWP->m_sWaypoint = szName;
+	pWP->m_dLat = dLat;
+	pWP->m_dLon = dLon;
+	rList.AddWP(pWP);
+}
+
+// Points all over, points within 1e-9 radians either side of the
+// radius, and ones without a usable position
+static void FillList(CWPList &rList, double dLat, double dLon,
+	double dDist)
+{
+	static const double aOffsets[] = {
+		-1e-9, -3e-10, -1e-10, 0.0, 1e-10, 3e-10, 1e-9
+	};
+	int i, j;
+
+	for (i=0; i<1500; i++)
+		AddPoint(rList, Random(-90.0, 90.0), Random(-180.0, 180.0));
+
+	for (i=0; i<300; i++)
+	{
+		double dBearing = Random(0.0, 2 * M_PI);
+		for (j=0; j<(int)(sizeof(aOffsets) / sizeof(aOffsets[0])); j++)
+		{
+			double dLat2, dLon2;
+			Destination(dLat, dLon, dDist + aOffsets[j], dBearing,
+				dLat2, dLon2);
+			AddPoint(rList, dLat2, dLon2);
+		}
+	}
+
+	AddPoint(rList, dLat, dLon);
+	AddPoint(rList, -dLat, dLon + 180.0);
+	AddPoint(rList, 91.0, 0.0);
+	AddPoint(rList, 0.0, 1e12);
+	AddPoint(rList, NAN, NAN);
+}
+
+// Points given with longitudes outside [-180, 180).  The grid and the
+// box wrap them by 360 degrees, while CheckRadius turns them into
+// radians with RAD_PER_DEG, which drifts from a full turn by about
+// 1.7e-7 radians every 360 degrees (see GRID_MAX_LON).
+static void AddWrapped(CWPList &rList, double dLat, double dLon,
+	double dDist)
+{
+	static const double aTurns[] = { 1e3, 1e4, 1e6 };
+	int i, k;
+
+	for (i=0; i<100; i++)
+	{
+		double dLat2, dLon2;
+		Destination(dLat, dLon, dDist * Random(0.9, 1.1),
+			Random(0.0, 2 * M_PI), dLat2, dLon2);
+
+		for (k=-3; k<=3; k++)
+		{
+			if (k)
+				AddPoint(rList, dLat2, dLon2 + 360.0 * k);
+		}
+	}
+
+	// Either side of the bound, for the center's latitude
+	AddPoint(rList, dLat, GRID_MAX_LON);
+	AddPoint(rList, dLat, -GRID_MAX_LON);
+	AddPoint(rList, dLat, GRID_MAX_LON + 1e-6);
+	AddPoint(rList, dLat, -GRID_MAX_LON - 1e-6);
+
+	// Where CheckRadius puts the point on the center, however far
+	// wrapping by 360 degrees puts it (lon 359999990.098 from 0,0
+	// was once dropped)
+	for (i=0; i<(int)(sizeof(aTurns) / sizeof(aTurns[0])); i++)
+	{
+		double dTurns = 2 * M_PI * aTurns[i] / RAD_PER_DEG;
+		AddPoint(rList, dLat, dLon + dTurns);
+		AddPoint(rList, dLat, dLon - dTurns);
+	}
+}
+
+// Number of waypoints on which the filter disagrees with CheckRadius
+static int CheckCenter(double dLat, double dLon, double dDist)
+{
+	CWPList list;
+	FillList(list, dLat, dLon, dDist);
+	AddWrapped(list, dLat, dLon, dDist);
+
+	CWPFilter filter;
+	filter.m_bRadius = 1;
+	filter.m_dLat = dLat;
+	filter.m_dLon = dLon;
+	filter.m_dDist = dDist;
+	filter.Compile();
+
+	int nFailed = 0;
+	int nPass;
+	WPList::iterator iter;
+
+	for (nPass=0; nPass<3; nPass++)
+	{
+		// Matching while parsing goes by the box, and afterwards by
+		// what MarkInRadius left.  The last pass adds records after
+		// the grid was built, which has to be built again.
+		if (nPass == 2)
+			FillList(list, -dLat, dLon + 90.0, dDist);
+		if (nPass >= 1)
+			filter.MarkInRadius(&list);
+
+		for (iter=list.m_List.begin(); iter!=list.m_List.end(); iter++)
+		{
+			CWPData *pWP = *iter;
+			int bWant = CWPFilter::CheckRadius(dLat, dLon,
+				pWP->m_dLat, pWP->m_dLon, dDist);
+
+			if (filter.Matches(pWP, 1) == bWant)
+				continue;
+
+			if (nFailed < 10)
+			{
+				static const char *aPass[] = {
+					"box", "marked", "added"
+				};
+				printf("FAIL: center %.9g,%.9g radius %.12g %s:"
+					" %.12g,%.12g should be %s\n",
+					dLat, dLon, dDist, aPass[nPass],
+					pWP->m_dLat, pWP->m_dLon,
+					bWant ? "in" : "out");
+			}
+			nFailed++;
+		}
+	}
+
+	return nFailed;
+}
+
+int main()
+{
+	// Poles, the 180th meridian and ordinary places
+	static const double aCenters[][2] = {
+		{ 90.0, 0.0 },
+		{ -90.0, 123.0 },
+		{ 89.99, -45.0 },
+		{ -89.5, 179.9 },
+		{ 0.0, -180.0 },
+		{ 10.0, 179.999999 },
+		{ -35.0, -179.75 },
+		{ 45.0, -120.0 },
+		{ 0.0, 0.0 }
+	};
+	// From a few meters to past half the globe, with radii either
+	// side of pi (where the batch test gives up)
+	static const double aRadii[] = {
+		1e-6, 1e-3, 0.05, 0.5, 1.5, M_PI / 2, 3.0,
+		M_PI - 1e-3, M_PI - 2e-6, M_PI - 1e-7, M_PI, 3.5
+	};
+	int nCenters = sizeof(aCenters) / sizeof(aCenters[0]);
+	int nRadii = sizeof(aRadii) / sizeof(aRadii[0]);
+	int nFailed = 0;
+	int i, j;
+
+	srand(1);
+
+	for (i=0; i<nCenters; i++)
+	{
+		for (j=0; j<nRadii; j++)
+		{
+			nFailed += CheckCenter(aCenters[i][0], aCenters[i][1],
+				aRadii[j]);
+		}
+	}
+
+	if (nFailed)
+		printf("%d distance filter checks failed\n", nFailed);
+
+	return (nFailed != 0);
+}
+
+#else
+
+// Without libm there is no distance filter to check
+int main()
+{
+	return 77;
+}
+
+#endif
@@ -20,6 +20,10 @@
 #include "common.h"
 #include "reader.h"
 
+#if HAVE_MMAP && HAVE_SYS_MMAN_H
+#include <sys/mman.h>
+#endif
+
 // Normal (unzipped) file reader
 
 int CXMLReader::Open(const char *szFile)
@@ -50,9 +54,89 @@ void CXMLReader::Close()
 	close(m_fp);
 }
 
+#if HAVE_MMAP && HAVE_SYS_MMAN_H
+// Memory-mapped file reader
+
+int CMapReader::Open(const char *szFile)
+{
+	struct stat info;
+
+	m_fp = open(szFile, O_RDONLY);
+	if (m_fp < 0)
+		return 0;
+
+	m_pData = NULL;
+	m_nLen = 0;
+	m_nPos = 0;
+
+	if (fstat(m_fp, &info) == 0 && S_ISREG(info.st_mode) &&
+		info.st_size > 0)
+	{
+		void *pMap = mmap(NULL, info.st_size, PROT_READ, MAP_PRIVATE,
+			m_fp, 0);
+		if (pMap != MAP_FAILED)
+		{
+			m_pData = (char*)pMap;
+			m_nLen = info.st_size;
+#if HAVE_MADVISE
+			madvise(pMap, m_nLen, MADV_SEQUENTIAL);
+#endif
+		}
+	}
+
+	return 1;
+}
+
+int CMapReader::Read(char *pBuf, int nLen)
+{
+	if (!m_pData)
+		return read(m_fp, pBuf, nLen);
+
+	if (nLen > m_nLen - m_nPos)
+		nLen = m_nLen - m_nPos;
+
+	memcpy(pBuf, m_pData + m_nPos, nLen);
+	m_nPos += nLen;
+
+	return nLen;
+}
+
+int CMapReader::GetMapping(const char *&rpData, long &rnLen)
+{
+	if (!m_pData)
+		return 0;
+
+	rpData = m_pData;
+	rnLen = m_nLen;
+	return 1;
+}
+
+int CMapReader::NextFile()
+{
+	return 0;
+}
+
+void CMapReader::Close()
+{
+	if (m_pData)
+		munmap(m_pData, m_nLen);
+
+	close(m_fp);
+}
+
+#endif // HAVE_MMAP && HAVE_SYS_MMAN_H
+
 #if HAVE_LIBZ && HAVE_LIBZZIP
 // Zipped file reader
 
+CZIPReader::CZIPReader()
+{
+	m_pDir = NULL;
+	m_pFile = NULL;
+	m_nJobs = 1;
+	m_bQuiet = 0;
+}
+
 int CZIPReader::Open(const char *szName)
 {
 	m_pDir = zzip_dir_open(szName, 0);
@@ -62,6 +146,20 @@ int CZIPReader::Open(const char *szName)
 	m_pFile = NULL;
 	m_sFile = szName;
 
+#if HAVE_PTHREAD_H && HAVE_LIBPTHREAD
+	if (m_nJobs > 1)
+	{
+		if (!OpenMembers())
+		{
+			printf("Couldn't find GPX file in %s\n", szName);
+			Close();
+			return 0;
+		}
+
+		return 1;
+	}
+#endif
+
 	if (!NextFile())
 	{
 		printf("Couldn't find GPX file in %s\n", szName);
@@ -72,19 +170,11 @@ int CZIPReader::Open(const char *szName)
 	return 1;
 }
 
-int CZIPReader::NextFile()
+int CZIPReader::FindGPXFile(ZZIP_DIRENT &rDirent)
 {
-	if (m_pFile)
-	{
-		zzip_file_close(m_pFile);
-		m_pFile = NULL;
-	}
-
-	int bFound = 0;
-	ZZIP_DIRENT dirent;
-	while (zzip_dir_read(m_pDir, &dirent))
+	while (zzip_dir_read(m_pDir, &rDirent))
 	{
-		string sName = dirent.d_name;
+		string sName = rDirent.d_name;
 		if (sName.size() < 5)
 			continue;
 
@@ -92,14 +182,30 @@ int CZIPReader::NextFile()
 		if (sExt != ".gpx" && sExt != ".GPX")
 			continue;
 
-		if (dirent.st_size == 0)
+		if (rDirent.st_size == 0)
 			continue;
 
-		bFound = 1;
-		break;
+		return 1;
+	}
+
+	return 0;
+}
+
+int CZIPReader::NextFile()
+{
+#if HAVE_PTHREAD_H && HAVE_LIBPTHREAD
+	if (!m_Members.empty())
+		return NextMember();
+#endif
+
+	if (m_pFile)
+	{
+		zzip_file_close(m_pFile);
+		m_pFile = NULL;
 	}
 
-	if (!bFound)
+	ZZIP_DIRENT dirent;
+	if (!FindGPXFile(dirent))
 		return 0;
 
 	if (!m_bQuiet)
@@ -114,15 +220,172 @@ int CZIPReader::NextFile()
 
 int CZIPReader::Read(char *pBuf, int nLen)
 {
+#if HAVE_PTHREAD_H && HAVE_LIBPTHREAD
+	if (!m_Members.empty())
+	{
+		string &rData = m_Members[m_nMember].sData;
+		long nLeft = rData.size() - m_nPos;
+		if (nLen > nLeft)
+			nLen = nLeft;
+
+		memcpy(pBuf, rData.data() + m_nPos, nLen);
+		m_nPos += nLen;
+		return nLen;
+	}
+#endif
+
 	return zzip_file_read(m_pFile, pBuf, nLen);
 }
 
+int CZIPReader::GetMapping(const char *&rpData, long &rnLen)
+{
+#if HAVE_PTHREAD_H && HAVE_LIBPTHREAD
+	if (!m_Members.empty())
+	{
+		rpData = m_Members[m_nMember].sData.data();
+		rnLen = m_Members[m_nMember].sData.size();
+		return 1;
+	}
+#endif
+
+	return 0;
+}
+
 void CZIPReader::Close()
 {
+#if HAVE_PTHREAD_H && HAVE_LIBPTHREAD
+	int i;
+	for (i=0; i<(int)m_Members.size(); i++)
+	{
+		if (m_Members[i].bStarted && !m_Members[i].bJoined)
+			pthread_join(m_Members[i].thread, NULL);
+	}
+
+	m_Members.clear();
+#endif
+
 	if (m_pFile)
 		zzip_file_close(m_pFile);
 
 	zzip_dir_close(m_pDir);
 }
 
+#if HAVE_PTHREAD_H && HAVE_LIBPTHREAD
+// List the GPX members up front and decompress up to m_nJobs of them
+// at a time, ahead of the parser
+int CZIPReader::OpenMembers()
+{
+	ZZIP_DIRENT dirent;
+	while (FindGPXFile(dirent))
+	{
+		stMember member;
+		member.pReader = this;
+		member.sName = dirent.d_name;
+		member.nSize = dirent.st_size;
+		member.bInflated = 0;
+		member.bStarted = 0;
+		member.bJoined = 0;
+		m_Members.push_back(member);
+	}
+
+	if (m_Members.empty())
+		return 0;
+
+	// Threads hold pointers into the vector, so it must not grow now.
+	// NextMember starts the last of the first m_nJobs.
+	int i;
+	for (i=0; i<m_nJobs-1; i++)
+		StartMember(i);
+
+	m_nMember = -1;
+	return NextMember();
+}
+
+int CZIPReader::NextMember()
+{
+	if (m_nMember >= 0)
+	{	// Done with the previous member's data
+		string sEmpty;
+		m_Members[m_nMember].sData.swap(sEmpty);
+	}
+
+	m_nMember++;
+	if (m_nMember >= (int)m_Members.size())
+		return 0;
+
+	StartMember(m_nMember + m_nJobs - 1);
+
+	stMember &rMember = m_Members[m_nMember];
+	if (!m_bQuiet)
+	{
+		printf("Found \"%s\" in ZIP file: %s\n", rMember.sName.c_str(),
+			m_sFile.c_str());
+	}
+
+	FinishMember(m_nMember);
+	m_nPos = 0;
+
+	return rMember.bInflated;
+}
+
+void CZIPReader::StartMember(int nMember)
+{
+	if (nMember >= (int)m_Members.size())
+		return;
+
+	stMember &rMember = m_Members[nMember];
+	rMember.bStarted = (pthread_create(&rMember.thread, NULL,
+		CZIPReader::InflateThread, &rMember) == 0);
+}
+
+void CZIPReader::FinishMember(int nMember)
+{
+	stMember &rMember = m_Members[nMember];
+
+	if (!rMember.bStarted)
+		rMember.bInflated = InflateMember(rMember);
+	else if (!rMember.bJoined)
+	{
+		pthread_join(rMember.thread, NULL);
+		rMember.bJoined = 1;
+	}
+}
+
+void* CZIPReader::InflateThread(void *pArg)
+{
+	stMember *pMember = (stMember*)pArg;
+
+	pMember->bInflated = pMember->pReader->InflateMember(*pMember);
+	return NULL;
+}
+
+int CZIPReader::InflateMember(stMember &rMember)
+{
+	// Each worker needs its own handle; a ZZIP_DIR shares one file
+	// position among its members
+	ZZIP_DIR *pDir = zzip_dir_open(m_sFile.c_str(), 0);
+	if (!pDir)
+		return 0;
+
+	ZZIP_FILE *pFile = zzip_file_open(pDir, rMember.sName.c_str(), 0);
+	if (!pFile)
+	{
+		zzip_dir_close(pDir);
+		return 0;
+	}
+
+	rMember.sData.reserve(rMember.nSize);
+
+	char buf[65536];
+	int len;
+	while ((len = zzip_file_read(pFile, buf, sizeof(buf))) > 0)
+		rMember.sData.append(buf, len);
+
+	zzip_file_close(pFile);
+	zzip_dir_close(pDir);
+
+	return (len == 0);
+}
+#endif
+
 #endif // HAVE_LIBZ && HAVE_LIBZZIP
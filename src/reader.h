@@ -29,6 +29,12 @@ public:
 	virtual int NextFile() = 0;
 	virtual void Close() = 0;
 
+	// Start and length of the whole current file in memory, for
+	// readers that can provide it
+	virtual int GetMapping(const char *&, long &) {
+		return 0;
+	}
+
 	virtual ~IXMLReader() {
 
 	}
@@ -48,6 +54,25 @@ private:
 	int m_fp;
 };
 
+#if HAVE_MMAP && HAVE_SYS_MMAN_H
+// Memory-mapped file reader (falls back to read() if mapping fails)
+class CMapReader : public IXMLReader
+{
+public:
+	virtual int Open(const char *szFile);
+	virtual int Read(char *pBuf, int nLen);
+	virtual int NextFile();
+	virtual void Close();
+	virtual int GetMapping(const char *&rpData, long &rnLen);
+
+private:
+	int m_fp;
+	char *m_pData;
+	long m_nLen;
+	long m_nPos;
+};
+#endif
+
 #if HAVE_LIBZ && HAVE_LIBZZIP
 extern "C" {
 #if HAVE_ZZIP_LIB_H
@@ -57,18 +82,56 @@ extern "C" {
 #endif
 }
 
+#if HAVE_PTHREAD_H && HAVE_LIBPTHREAD
+#include <pthread.h>
+#endif
+
 class CZIPReader : public IXMLReader
 {
 public:
+	CZIPReader();
+
 	virtual int Open(const char *szFile);
 	virtual int Read(char *pBuf, int nLen);
 	virtual int NextFile();
 	virtual void Close();
+	virtual int GetMapping(const char *&rpData, long &rnLen);
+
+	// Number of GPX members to decompress at once
+	int m_nJobs;
 
 private:
 	ZZIP_DIR *m_pDir;
 	ZZIP_FILE *m_pFile;
 	string m_sFile;
+
+#if HAVE_PTHREAD_H && HAVE_LIBPTHREAD
+	// GPX member decompressed into memory by a worker thread
+	typedef struct
+	{
+		CZIPReader *pReader;
+		string sName;
+		long nSize;
+		string sData;
+		int bInflated;
+		int bStarted;
+		int bJoined;
+		pthread_t thread;
+	} stMember;
+
+	vector<stMember> m_Members;
+	int m_nMember;
+	long m_nPos;
+
+	int OpenMembers();
+	int NextMember();
+	void StartMember(int nMember);
+	void FinishMember(int nMember);
+	int InflateMember(stMember &rMember);
+	static void* InflateThread(void *pArg);
+#endif
+
+	int FindGPXFile(ZZIP_DIRENT &rDirent);
 };
 #endif
 
@@ -0,0 +1,134 @@
+/*
+    Copyright 2003-2010 Brian Smith (brian@smittyware.com)
+    This file is part of CMConvert.
+
+    CMConvert is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    CMConvert is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with CMConvert; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+*/
+
+#include "common.h"
+#include "ring.h"
+
+#if HAVE_PTHREAD_H && HAVE_LIBPTHREAD
+
+CBufferRing::CBufferRing(int nSlots, int nSlotSize)
+{
+	m_nSlots = nSlots;
+	m_nSlotSize = nSlotSize;
+	m_pData = new char[nSlots * nSlotSize];
+	m_pLens = new int[nSlots];
+	m_pLast = new int[nSlots];
+
+	m_nHead = 0;
+	m_nTail = 0;
+	m_bCancel = 0;
+	m_nWaiters = 0;
+
+	pthread_mutex_init(&m_Lock, NULL);
+	pthread_cond_init(&m_Wake, NULL);
+}
+
+CBufferRing::~CBufferRing()
+{
+	pthread_cond_destroy(&m_Wake);
+	pthread_mutex_destroy(&m_Lock);
+
+	delete [] m_pLast;
+	delete [] m_pLens;
+	delete [] m_pData;
+}
+
+// Sleep until the other side moves.  The waiter count is raised before
+// the ring is checked again, and the other side reads it after moving
+// its counter, so one of them always sees the other.
+void CBufferRing::Wait(int bProducer)
+{
+	pthread_mutex_lock(&m_Lock);
+	m_nWaiters++;
+
+	for (;;)
+	{
+		if (m_bCancel)
+			break;
+
+		unsigned nUsed = m_nHead - m_nTail;
+		if (bProducer ? (nUsed < (unsigned)m_nSlots) : (nUsed > 0))
+			break;
+
+		pthread_cond_wait(&m_Wake, &m_Lock);
+	}
+
+	m_nWaiters--;
+	pthread_mutex_unlock(&m_Lock);
+}
+
+void CBufferRing::Wake()
+{
+	if (m_nWaiters == 0)
+		return;
+
+	pthread_mutex_lock(&m_Lock);
+	pthread_cond_broadcast(&m_Wake);
+	pthread_mutex_unlock(&m_Lock);
+}
+
+char* CBufferRing::GetFree()
+{
+	if (m_nHead - m_nTail >= (unsigned)m_nSlots)
+		Wait(1);
+
+	if (m_bCancel)
+		return NULL;
+
+	return m_pData + (m_nHead % m_nSlots) * m_nSlotSize;
+}
+
+void CBufferRing::Publish(int nLen, int bLast)
+{
+	int nSlot = m_nHead % m_nSlots;
+	m_pLens[nSlot] = nLen;
+	m_pLast[nSlot] = bLast;
+
+	m_nHead++;
+	Wake();
+}
+
+const char* CBufferRing::GetFull(int &rnLen, int &rbLast)
+{
+	if (m_nHead == m_nTail)
+		Wait(0);
+
+	int nSlot = m_nTail % m_nSlots;
+	rnLen = m_pLens[nSlot];
+	rbLast = m_pLast[nSlot];
+
+	return m_pData + nSlot * m_nSlotSize;
+}
+
+void CBufferRing::Release()
+{
+	m_nTail++;
+	Wake();
+}
+
+void CBufferRing::Cancel()
+{
+	m_bCancel = 1;
+
+	pthread_mutex_lock(&m_Lock);
+	pthread_cond_broadcast(&m_Wake);
+	pthread_mutex_unlock(&m_Lock);
+}
+
+#endif // HAVE_PTHREAD_H && HAVE_LIBPTHREAD
@@ -0,0 +1,73 @@
+/*
+    Copyright 2003-2010 Brian Smith (brian@smittyware.com)
+    This file is part of CMConvert.
+
+    CMConvert is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    CMConvert is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with CMConvert; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+*/
+
+#ifndef _RING_H_INCLUDED_
+#define _RING_H_INCLUDED_
+
+#if HAVE_PTHREAD_H && HAVE_LIBPTHREAD
+#include <pthread.h>
+#include <atomic>
+
+// Buffers in flight between the reader thread and the parser
+#define RING_SLOTS 4
+
+// Ring of reusable buffers passed from one producer thread to one
+// consumer thread.  Slots change hands through atomic counters; a side
+// only takes the lock when it has to sleep on an empty or full ring.
+class CBufferRing
+{
+public:
+	CBufferRing(int nSlots, int nSlotSize);
+	~CBufferRing();
+
+	int SlotSize() const { return m_nSlotSize; }
+
+	// Producer: wait for an empty slot (NULL once cancelled), then
+	// hand it over holding nLen bytes
+	char* GetFree();
+	void Publish(int nLen, int bLast);
+
+	// Consumer: wait for a filled slot, then give it back
+	const char* GetFull(int &rnLen, int &rbLast);
+	void Release();
+	// Consumer is done early; wakes and stops the producer
+	void Cancel();
+
+private:
+	int m_nSlots;
+	int m_nSlotSize;
+	char *m_pData;
+	int *m_pLens;
+	int *m_pLast;
+
+	// Slots ever published and released
+	std::atomic<unsigned> m_nHead;
+	std::atomic<unsigned> m_nTail;
+	std::atomic<int> m_bCancel;
+	std::atomic<int> m_nWaiters;
+
+	pthread_mutex_t m_Lock;
+	pthread_cond_t m_Wake;
+
+	void Wait(int bProducer);
+	void Wake();
+};
+#endif
+
+#endif // _RING_H_INCLUDED_
@@ -0,0 +1,54 @@
+#!/bin/sh
+# Checks that a pocket query using namespace prefixes it never declares
+# (xsi: and groundspeak: here) is still read, both in one pass and
+# split across -j parse threads.  Run by "make check".
+
+GPX=unboundtest.gpx
+OUT=unboundtest.out
+COUNT=8000
+
+awk -v count=$COUNT 'BEGIN {
+	print "<?xml version=\"1.0\" encoding=\"utf-8\"?>"
+	print "<gpx xsi:schemaLocation=\"http://www.topografix.com/GPX/1/0 gpx.xsd\" version=\"1.0\" creator=\"Groundspeak\" xmlns=\"http://www.topografix.com/GPX/1/0\">"
+	for (i = 0; i < count; i++) {
+		printf "<wpt lat=\"%.6f\" lon=\"%.6f\">", 40 + i / 10000, -120 + i / 10000
+		printf "<time>2005-03-01T08:00:00</time><name>GC%05X</name>", i
+		printf "<desc>Cache %d by someone</desc><sym>Geocache</sym>", i
+		printf "<type>Geocache|Traditional Cache</type>\n"
+		printf "<groundspeak:cache id=\"%d\" available=\"True\" archived=\"False\">", i
+		printf "<groundspeak:name>Cache %d</groundspeak:name>", i
+		printf "<groundspeak:placed_by>someone</groundspeak:placed_by>"
+		printf "<groundspeak:type>Traditional Cache</groundspeak:type>"
+		printf "<groundspeak:container>Regular</groundspeak:container>"
+		printf "<groundspeak:difficulty>1.5</groundspeak:difficulty>"
+		printf "<groundspeak:terrain>2</groundspeak:terrain>"
+		printf "<groundspeak:long_description html=\"False\">"
+		printf "A cache hidden for testing, with enough text to make "
+		printf "the file large enough to be split between threads."
+		printf "</groundspeak:long_description>"
+		printf "</groundspeak:cache></wpt>\n"
+	}
+	print "</gpx>"
+}' > $GPX
+
+status=0
+for jobs in 1 3; do
+	./cmconvert -j $jobs -l $GPX > $OUT.$jobs
+	if grep -q "error" $OUT.$jobs; then
+		echo "FAIL: -j $jobs reported an error"
+		status=1
+	fi
+	lines=`grep -c "^GC" $OUT.$jobs`
+	if test "$lines" != "$COUNT"; then
+		echo "FAIL: -j $jobs listed $lines of $COUNT waypoints"
+		status=1
+	fi
+done
+
+if ! cmp -s $OUT.1 $OUT.3; then
+	echo "FAIL: -j 3 listing differs from -j 1"
+	status=1
+fi
+
+rm -f $GPX $OUT.1 $OUT.3
+exit $status
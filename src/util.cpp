@@ -34,10 +34,41 @@ void CUtil::LowercaseString(string &sStr)
 
 void CUtil::StripWhitespace(string &rStr)
 {
-        while (strchr(" \t\r\n", rStr[0]) != NULL && rStr.size() > 0)
-                rStr = rStr.substr(1);
+        // A NUL counts as whitespace too (as it always has with strchr)
+        static const char szSpace[] = " \t\r\n";
 
-        int nLen = rStr.size();
-        while (nLen > 0 && strchr(" \t\r\n", rStr[nLen-1]) != NULL)
-                rStr = rStr.substr(0, --nLen);
+        size_t nEnd = rStr.find_last_not_of(szSpace, string::npos,
+                sizeof(szSpace));
+        if (nEnd == string::npos)
+        {
+                rStr.erase();
+                return;
+        }
+
+        rStr.erase(nEnd + 1);
+        rStr.erase(0, rStr.find_first_not_of(szSpace, 0, sizeof(szSpace)));
+}
+
+// Like a search of a lowercased copy, without making the copy
+int CUtil::ContainsNoCase(const string &rStr, const char *szLower)
+{
+        int nLen = strlen(szLower);
+        int i, j, n = rStr.size() - nLen;
+
+        for (i=0; i<=n; i++)
+        {
+                for (j=0; j<nLen; j++)
+                {
+                        char ch = rStr[i+j];
+                        if (ch >= 'A' && ch <= 'Z')
+                                ch = ch - 'A' + 'a';
+                        if (ch != szLower[j])
+                                break;
+                }
+
+                if (j == nLen)
+                        return 1;
+        }
+
+        return 0;
 }
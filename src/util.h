@@ -25,6 +25,7 @@ class CUtil
 public:
 	static void LowercaseString(string &sStr);
 	static void StripWhitespace(string &rStr);
+	static int ContainsNoCase(const string &rStr, const char *szLower);
 };
 
 #endif // _UTIL_H_INCLUDED_
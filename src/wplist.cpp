@@ -20,11 +20,39 @@
 #include "common.h"
 #include "wplist.h"
 
+#include <new>
+
 CWPData::CWPData()
 {
 	m_bConvert = 0;
 	m_bTravelBugs = 0;
 	m_bTruncated = 0;
+	m_bFiltered = 0;
+	m_bInRadius = 0;
+	m_pDeferred = NULL;
+	m_pSameWP = NULL;
+}
+
+CWPData::~CWPData()
+{
+	delete m_pDeferred;
+}
+
+void CWPData::FinishRecord()
+{
+	if (!m_pDeferred)
+		return;
+
+	m_pDeferred->Finish(this);
+	delete m_pDeferred;
+	m_pDeferred = NULL;
+}
+
+// Whether the coordinates are a place on the globe that wrapping the
+// longitude finds (bad or missing ones can be anything)
+int CWPData::HasPosition()
+{
+	return (fabs(m_dLat) <= 90.0 && fabs(m_dLon) <= GRID_MAX_LON);
 }
 
 void CWPData::Update(CWPData *pData)
@@ -45,9 +73,20 @@ void CWPData::Update(CWPData *pData)
 	m_bTruncated = pData->m_bTruncated;
 	m_bTravelBugs = pData->m_bTravelBugs;
 	m_bActive = pData->m_bActive;
+	m_bFiltered = pData->m_bFiltered;
 
 	m_dLat = pData->m_dLat;
 	m_dLon = pData->m_dLon;
+
+	// Take over any conversion still pending for the new data
+	delete m_pDeferred;
+	m_pDeferred = pData->m_pDeferred;
+	pData->m_pDeferred = NULL;
+}
+
+CWPList::CWPList()
+{
+	m_bGridBuilt = 0;
 }
 
 CWPList::~CWPList()
@@ -60,48 +99,172 @@ void CWPList::Clear()
 	WPList::iterator iter = m_List.begin();
 	while (iter != m_List.end())
 	{
-		delete *iter;
+		DeleteWP(*iter);
 		iter++;
 	}
 
-	m_List.clear();
+	ReleaseAll();
+	m_Arena.Release();
 
 	m_sCurTS.erase();
 }
 
-int CWPList::AlreadyInList(CWPData *pWP)
+CWPData* CWPList::NewWP()
 {
-	WPList::iterator iter = m_List.begin();
-	while (iter != m_List.end())
+	return new (m_Arena.Alloc(sizeof(CWPData))) CWPData();
+}
+
+// The memory itself goes when the arena is released
+void CWPList::DeleteWP(CWPData *pWP)
+{
+	pWP->~CWPData();
+}
+
+// Forget all records without deleting them (ownership has moved)
+void CWPList::ReleaseAll()
+{
+	m_List.clear();
+	m_WPIndex.clear();
+	m_RecIndex.clear();
+	m_Grid.clear();
+	m_bGridBuilt = 0;
+}
+
+// Records are indexed by their leading name and waypoint fields, which
+// are known even while the rest of the record is still deferred
+size_t CWPList::RecordDigest(CWPData *pWP)
+{
+	return hash<string>()(pWP->m_sDesc) * 31 +
+		hash<string>()(pWP->m_sWaypoint);
+}
+
+int CWPList::SameRecord(CWPData *pWP1, CWPData *pWP2)
+{
+	// Records of filtered waypoints were never built
+	if (pWP1->m_bFiltered || pWP2->m_bFiltered)
+		return 0;
+
+	// The same input always converts to the same record (the parser
+	// keeps the fields a waypoint is listed by out of its input)
+	if (pWP1->m_pDeferred && pWP2->m_pDeferred &&
+			SameListedFields(pWP1, pWP2) &&
+			pWP1->m_pDeferred->SameInput(pWP2->m_pDeferred))
+		return 1;
+
+	pWP1->FinishRecord();
+	pWP2->FinishRecord();
+	return (pWP1->m_sRecord == pWP2->m_sRecord);
+}
+
+int CWPList::SameListedFields(CWPData *pWP1, CWPData *pWP2)
+{
+	return (pWP1->m_sWaypoint == pWP2->m_sWaypoint &&
+		pWP1->m_sDesc == pWP2->m_sDesc &&
+		pWP1->m_sDiff == pWP2->m_sDiff &&
+		pWP1->m_sTerrain == pWP2->m_sTerrain &&
+		pWP1->m_sSymbol == pWP2->m_sSymbol &&
+		pWP1->m_sType == pWP2->m_sType &&
+		pWP1->m_sContainer == pWP2->m_sContainer &&
+		pWP1->m_sState == pWP2->m_sState &&
+		pWP1->m_sCountry == pWP2->m_sCountry &&
+		pWP1->m_sOwner == pWP2->m_sOwner);
+}
+
+void CWPList::IndexRecord(CWPData *pWP)
+{
+	m_RecIndex.insert(RecordIndex::value_type(
+		RecordDigest(pWP), pWP));
+
+	// New or moved records have to be placed again
+	m_bGridBuilt = 0;
+}
+
+void CWPList::UnindexRecord(CWPData *pWP)
+{
+	pair<RecordIndex::iterator, RecordIndex::iterator> range =
+		m_RecIndex.equal_range(RecordDigest(pWP));
+
+	RecordIndex::iterator iter = range.first;
+	while (iter != range.second)
 	{
-		if ((*iter)->m_sRecord == pWP->m_sRecord)
-			return 1;
+		if (iter->second == pWP)
+		{
+			m_RecIndex.erase(iter);
+			break;
+		}
 
 		iter++;
 	}
+}
 
-	return 0;
+void CWPList::AppendWP(CWPData *pWP)
+{
+	m_List.push_back(pWP);
+
+	// First record with a given ID wins, as with a list scan; any
+	// later ones are chained after it
+	pWP->m_pSameWP = NULL;
+	pair<WPIndex::iterator, bool> result = m_WPIndex.insert(
+		WPIndex::value_type(pWP->m_sWaypoint, pWP));
+	if (!result.second)
+	{
+		CWPData *pLast = result.first->second;
+		while (pLast->m_pSameWP)
+			pLast = pLast->m_pSameWP;
+
+		pLast->m_pSameWP = pWP;
+	}
+
+	IndexRecord(pWP);
 }
 
-CWPData* CWPList::GetByWP(string sWP)
+int CWPList::AlreadyInList(CWPData *pWP)
 {
-	WPList::iterator iter = m_List.begin();
-	while (iter != m_List.end())
+	pair<RecordIndex::iterator, RecordIndex::iterator> range =
+		m_RecIndex.equal_range(RecordDigest(pWP));
+
+	RecordIndex::iterator iter = range.first;
+	while (iter != range.second)
 	{
-		CWPData *pData = *iter;
-		if (pData->m_sWaypoint == sWP)
-			return pData;
+		if (SameRecord(iter->second, pWP))
+			return 1;
 
 		iter++;
 	}
 
+	return 0;
+}
+
+CWPData* CWPList::GetByWP(string sWP)
+{
+	WPIndex::iterator iter = m_WPIndex.find(sWP);
+	if (iter != m_WPIndex.end())
+		return iter->second;
+
 	return NULL;
 }
 
+// All records with an ID, in list order
+void CWPList::FindByWP(const string &rWP, WPList &rFound)
+{
+	WPIndex::iterator iter = m_WPIndex.find(rWP);
+	if (iter == m_WPIndex.end())
+		return;
+
+	CWPData *pWP = iter->second;
+	while (pWP)
+	{
+		rFound.push_back(pWP);
+		pWP = pWP->m_pSameWP;
+	}
+}
+
 void CWPList::AddWP(CWPData *pWP)
 {
 	if (!AlreadyInList(pWP))
-		m_List.push_back(pWP);
+		AppendWP(pWP);
+	else
+		DeleteWP(pWP);
 }
 
 int CWPList::CompareTimestamps(string sFileTS, int &bNewIsLater)
@@ -205,7 +368,16 @@ void CWPList::AddList(CWPList *pList, string sFileTS)
 	else
 		MergeByRecordContent(pList);
 
-	pList->m_List.clear();
+	pList->ReleaseAll();
+	m_Arena.Adopt(pList->m_Arena);
+}
+
+// Add records from the same file, as if by AddWP
+void CWPList::AppendList(CWPList *pList)
+{
+	MergeByRecordContent(pList);
+	pList->ReleaseAll();
+	m_Arena.Adopt(pList->m_Arena);
 }
 
 void CWPList::MergeByTimestamp(CWPList *pList, int bLater)
@@ -219,12 +391,16 @@ void CWPList::MergeByTimestamp(CWPList *pList, int bLater)
 		if (pOldWP)
 		{
 			if (bLater)
+			{
+				UnindexRecord(pOldWP);
 				pOldWP->Update(pWP);
+				IndexRecord(pOldWP);
+			}
 
-			delete pWP;
+			DeleteWP(pWP);
 		}
 		else
-			m_List.push_back(pWP);
+			AppendWP(pWP);
 
 		iter++;
 	}	
@@ -238,10 +414,116 @@ void CWPList::MergeByRecordContent(CWPList *pList)
 		CWPData *pWP = (*iter);
 
 		if (!AlreadyInList(pWP))
-			m_List.push_back(pWP);
+			AppendWP(pWP);
+		else
+			DeleteWP(pWP);
+
+		iter++;
+	}
+}
+
+#ifdef HAVE_LIBM
+static bool GridEntryLess(const stGridEntry &rEntry1,
+	const stGridEntry &rEntry2)
+{
+	return (rEntry1.nCell < rEntry2.nCell);
+}
+
+long CWPList::GridRow(double dLat)
+{
+	long nRow = (long)floor((dLat + 90) / GRID_CELL_DEG);
+	if (nRow < 0)
+		nRow = 0;
+	else if (nRow >= GRID_ROWS)
+		nRow = GRID_ROWS - 1;
+
+	return nRow;
+}
+
+long CWPList::GridCol(double dLon)
+{
+	double dPos = fmod(dLon + 180, 360);
+	if (dPos < 0)
+		dPos += 360;
+
+	long nCol = (long)(dPos / GRID_CELL_DEG);
+	if (nCol >= GRID_COLS)
+		nCol = GRID_COLS - 1;
+
+	return nCol;
+}
+
+void CWPList::BuildGrid()
+{
+	m_Grid.resize(m_List.size());
+
+	int i, n = m_List.size();
+	for (i=0; i<n; i++)
+	{
+		CWPData *pWP = m_List[i];
+		stGridEntry &rEntry = m_Grid[i];
+
+		rEntry.pWP = pWP;
+		if (pWP->HasPosition())
+		{
+			rEntry.nCell = GridRow(pWP->m_dLat) * GRID_COLS +
+				GridCol(pWP->m_dLon);
+		}
 		else
-			delete pWP;
+			rEntry.nCell = -1;
+	}
+
+	stable_sort(m_Grid.begin(), m_Grid.end(), GridEntryLess);
+	m_bGridBuilt = 1;
+}
+
+void CWPList::FindInCells(long nFirst, long nLast, WPList &rFound)
+{
+	stGridEntry key;
+	key.nCell = nFirst;
+	key.pWP = NULL;
 
+	WPGrid::iterator iter = lower_bound(m_Grid.begin(), m_Grid.end(),
+		key, GridEntryLess);
+	while (iter != m_Grid.end() && iter->nCell <= nLast)
+	{
+		rFound.push_back(iter->pWP);
 		iter++;
 	}
 }
+
+// Records in the cells that cover a box around a point (in degrees; a
+// longitude span of 180 or more takes in every longitude), plus those
+// the grid can't place
+void CWPList::FindNear(double dLat, double dLon, double dLatSpan,
+	double dLonSpan, WPList &rFound)
+{
+	if (!m_bGridBuilt)
+		BuildGrid();
+
+	FindInCells(-1, -1, rFound);
+
+	long nRow, nLastRow = GridRow(dLat + dLatSpan);
+	for (nRow=GridRow(dLat - dLatSpan); nRow<=nLastRow; nRow++)
+	{
+		long nBase = nRow * GRID_COLS;
+
+		if (dLonSpan >= 180)
+		{
+			FindInCells(nBase, nBase + GRID_COLS - 1, rFound);
+			continue;
+		}
+
+		long nFirstCol = GridCol(dLon - dLonSpan);
+		long nLastCol = GridCol(dLon + dLonSpan);
+		if (nFirstCol <= nLastCol)
+			FindInCells(nBase + nFirstCol, nBase + nLastCol, rFound);
+		else
+		{	// Across the 180th meridian
+			FindInCells(nBase + nFirstCol, nBase + GRID_COLS - 1,
+				rFound);
+			FindInCells(nBase, nBase + nLastCol, rFound);
+		}
+	}
+}
+#endif
@@ -20,12 +20,27 @@
 #ifndef _WPLIST_H_INCLUDED_
 #define _WPLIST_H_INCLUDED_
 
+class CWPData;
+
+// Conversion of a waypoint record put off until it is known to be wanted
+class IDeferredRecord
+{
+public:
+	virtual ~IDeferredRecord() {}
+
+	virtual void Finish(CWPData *pWP) = 0;
+	virtual int SameInput(IDeferredRecord *pOther) = 0;
+};
+
 class CWPData
 {
 public:
 	CWPData();
+	~CWPData();
 
 	void Update(CWPData *pData);
+	void FinishRecord();
+	int HasPosition();
 
 	string m_sWaypoint;
 	string m_sRecord;
@@ -45,23 +60,71 @@ public:
 	int m_bTravelBugs;
 	int m_bTruncated;
 	int m_bActive;
+	int m_bFiltered;	// Dropped by the filters while parsing
+	int m_bInRadius;	// Set by CWPFilter::MarkInRadius
 
 	double m_dLat;
 	double m_dLon;
+
+	// Until finished, m_sRecord, m_sURL, m_sLinks and m_bTruncated
+	// are not filled in
+	IDeferredRecord *m_pDeferred;
+
+	// Next record in the list with the same waypoint ID
+	CWPData *m_pSameWP;
 };
 
-#include <list>
-typedef list<CWPData*> WPList;
+#include <unordered_map>
+#include "arena.h"
+
+// Records in input order.  The records themselves never move (they
+// live in the list's arena), so pointers to them stay good as the
+// list grows.
+typedef vector<CWPData*> WPList;
+
+// Lookup indexes (waypoint ID and record content digest)
+typedef unordered_map<string, CWPData*> WPIndex;
+typedef unordered_multimap<size_t, CWPData*> RecordIndex;
+
+// Grid of records by position (in cells of GRID_CELL_DEG degrees).
+// Records without usable coordinates are kept in cell -1, which every
+// search takes in.
+#define GRID_CELL_DEG 0.5
+#define GRID_ROWS 360
+#define GRID_COLS 720
+// Largest longitude that is placed by position.  The grid and the
+// filter boxes wrap longitudes by exactly 360 degrees, but the exact
+// distance tests turn degrees into radians with the filter's rounded
+// RAD_PER_DEG, so 360 of its degrees are about 1.7e-7 radians more than
+// a full turn.  Against a center in [-180, 180) that adds up over at
+// most two turns here, which the filter's RADIUS_SLACK of 1e-6 radians
+// covers; points further out are checked one by one.
+#define GRID_MAX_LON 540.0
+typedef struct
+{
+	long nCell;
+	CWPData *pWP;
+} stGridEntry;
+typedef vector<stGridEntry> WPGrid;
 
 class CWPList
 {
 public:
+	CWPList();
 	~CWPList();
 
+	// Records live in the list's arena, so they must come from here
+	CWPData* NewWP();
 	void AddWP(CWPData *pWP);
 	void AddList(CWPList *pList, string sFileTS);
+	void AppendList(CWPList *pList);
 
 	CWPData* GetByWP(string sWP);
+	void FindByWP(const string &rWP, WPList &rFound);
+#ifdef HAVE_LIBM
+	void FindNear(double dLat, double dLon, double dLatSpan,
+		double dLonSpan, WPList &rFound);
+#endif
 	
 	void Clear();
 
@@ -69,6 +132,26 @@ public:
 
 private:
 	string m_sCurTS;
+	WPIndex m_WPIndex;
+	RecordIndex m_RecIndex;
+	CArena m_Arena;
+	WPGrid m_Grid;
+	int m_bGridBuilt;
+
+	void AppendWP(CWPData *pWP);
+#ifdef HAVE_LIBM
+	void BuildGrid();
+	void FindInCells(long nFirst, long nLast, WPList &rFound);
+	static long GridRow(double dLat);
+	static long GridCol(double dLon);
+#endif
+	void DeleteWP(CWPData *pWP);
+	void ReleaseAll();
+	void IndexRecord(CWPData *pWP);
+	void UnindexRecord(CWPData *pWP);
+	static size_t RecordDigest(CWPData *pWP);
+	static int SameRecord(CWPData *pWP1, CWPData *pWP2);
+	static int SameListedFields(CWPData *pWP1, CWPData *pWP2);
 
 	int AlreadyInList(CWPData *pWP);
 	int CompareTimestamps(string sFileTS, int &bNewIsLater);
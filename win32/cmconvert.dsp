@@ -87,6 +87,18 @@ LINK32=link.exe
 # PROP Default_Filter "cpp;c;cxx;rc;def;r;odl;idl;hpj;bat"
 # Begin Source File
 
+SOURCE=..\src\arena.cpp
+# End Source File
+# Begin Source File
+
+SOURCE=..\src\charref.cpp
+# End Source File
+# Begin Source File
+
+SOURCE=..\src\filter.cpp
+# End Source File
+# Begin Source File
+
 SOURCE=..\src\getopt.c
 # End Source File
 # Begin Source File
@@ -95,6 +107,10 @@ SOURCE=..\src\getopt1.c
 # End Source File
 # Begin Source File
 
+SOURCE=..\src\gpxsplit.cpp
+# End Source File
+# Begin Source File
+
 SOURCE=..\src\htmlwriter.cpp
 # End Source File
 # Begin Source File
@@ -111,6 +127,10 @@ SOURCE=..\src\parser.cpp
 # End Source File
 # Begin Source File
 
+SOURCE=..\src\pathtrie.cpp
+# End Source File
+# Begin Source File
+
 SOURCE=..\src\pdbwriter.cpp
 # End Source File
 # Begin Source File
@@ -119,6 +139,10 @@ SOURCE=..\src\reader.cpp
 # End Source File
 # Begin Source File
 
+SOURCE=..\src\ring.cpp
+# End Source File
+# Begin Source File
+
 SOURCE=..\src\util.cpp
 # End Source File
 # Begin Source File
@@ -135,6 +159,14 @@ SOURCE=".\cmconvert-stdint.h"
 # End Source File
 # Begin Source File
 
+SOURCE=..\src\arena.h
+# End Source File
+# Begin Source File
+
+SOURCE=..\src\charref.h
+# End Source File
+# Begin Source File
+
 SOURCE=..\src\common.h
 # End Source File
 # Begin Source File
@@ -143,10 +175,18 @@ SOURCE=.\config.h
 # End Source File
 # Begin Source File
 
+SOURCE=..\src\filter.h
+# End Source File
+# Begin Source File
+
 SOURCE=..\src\getopt.h
 # End Source File
 # Begin Source File
 
+SOURCE=..\src\gpxsplit.h
+# End Source File
+# Begin Source File
+
 SOURCE=..\src\htmlwriter.h
 # End Source File
 # Begin Source File
@@ -155,6 +195,10 @@ SOURCE=..\src\parser.h
 # End Source File
 # Begin Source File
 
+SOURCE=..\src\pathtrie.h
+# End Source File
+# Begin Source File
+
 SOURCE=..\src\pdb.h
 # End Source File
 # Begin Source File
@@ -167,6 +211,10 @@ SOURCE=..\src\reader.h
 # End Source File
 # Begin Source File
 
+SOURCE=..\src\ring.h
+# End Source File
+# Begin Source File
+
 SOURCE=..\src\util.h
 # End Source File
 # Begin Source File